@@ -0,0 +1,1068 @@
+// ----------------------------------------------------------------------------
+//  NeoVis
+//  Copyright(c) 2017-2024 Ogma Intelligent Systems Corp. All rights reserved.
+//
+//  This copy of NeoVis is licensed to you under the terms described
+//  in the NEOVIS_LICENSE.md file included in this distribution.
+// ----------------------------------------------------------------------------
+
+// Measures the adapter's and viewer's hot paths on synthetic hierarchies, without AOgmaNeo or SFML.
+// Built with -DNEOVIS_BENCH=ON, or on its own:
+//   g++ -O2 -std=c++14 -Isource bench/neovis_bench.cpp source/codec.cpp -o neovis_bench -pthread
+// Run with the name of a section (serialize, parse, latency) to run just that one
+
+#include "codec.h"
+#include "protocol.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define NEOVIS_BENCH_SOCKETS
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+typedef std::chrono::steady_clock bench_clock;
+
+double seconds_since(bench_clock::time_point start) {
+    return std::chrono::duration<double>(bench_clock::now() - start).count();
+}
+
+struct Bench_Layer {
+    int width;
+    int height;
+    int column_size;
+
+    std::vector<int> cis;
+};
+
+// num_layers layers of width x height columns of column_size cells, with random active cells
+std::vector<Bench_Layer> make_hierarchy(int num_layers, int width, int height, int column_size, unsigned int seed) {
+    std::mt19937 rng(seed);
+
+    std::uniform_int_distribution<int> cell(0, column_size - 1);
+
+    std::vector<Bench_Layer> layers(num_layers);
+
+    for (int l = 0; l < num_layers; l++) {
+        layers[l].width = width;
+        layers[l].height = height;
+        layers[l].column_size = column_size;
+
+        layers[l].cis.resize(width * height);
+
+        for (int i = 0; i < layers[l].cis.size(); i++)
+            layers[l].cis[i] = cell(rng);
+    }
+
+    return layers;
+}
+
+// --------------------------- Serialize ----------------------------
+
+// How the adapter used to append values, growing the frame by each one
+template<class T>
+void push_grow(std::vector<unsigned char> &data, T value) {
+    size_t start = data.size();
+
+    data.resize(start + sizeof(T));
+
+    std::memcpy(&data[start], &value, sizeof(T));
+}
+
+// Every layer rebuilt for every client as 16-bit indices, into a fresh buffer
+size_t serialize_per_client(const std::vector<Bench_Layer> &layers, int num_clients) {
+    size_t total = 0;
+
+    for (int c = 0; c < num_clients; c++) {
+        std::vector<unsigned char> data;
+
+        push_grow<std::uint16_t>(data, static_cast<std::uint16_t>(layers.size()));
+        push_grow<std::uint16_t>(data, 0);
+
+        for (int l = 0; l < layers.size(); l++) {
+            push_grow<std::uint16_t>(data, static_cast<std::uint16_t>(layers[l].width));
+            push_grow<std::uint16_t>(data, static_cast<std::uint16_t>(layers[l].height));
+            push_grow<std::uint16_t>(data, static_cast<std::uint16_t>(layers[l].column_size));
+
+            for (int i = 0; i < layers[l].cis.size(); i++)
+                push_grow<std::uint16_t>(data, static_cast<std::uint16_t>(layers[l].cis[i]));
+        }
+
+        total += data.size();
+    }
+
+    return total;
+}
+
+// A full layer as push_csdr writes it, one packed index per column
+void encode_layer(Frame_Writer &writer, const Bench_Layer &layer) {
+    int index_bits = bits_for(layer.column_size);
+
+    writer.push<std::uint8_t>(csdr_encoding_packed);
+
+    pack_bits(layer.cis.data(), layer.cis.size(), index_bits, writer.add(packed_size(layer.cis.size(), index_bits)));
+}
+
+// Packed layers, but still encoded again for each client
+size_t serialize_packed_per_client(const std::vector<Bench_Layer> &layers, int num_clients, Frame_Writer &frame) {
+    size_t total = 0;
+
+    for (int c = 0; c < num_clients; c++) {
+        frame.clear();
+
+        frame.add(sizeof(Frame_Header));
+
+        frame.push<std::uint32_t>(1);
+
+        for (int l = 0; l < layers.size(); l++)
+            encode_layer(frame, layers[l]);
+
+        total += frame.get_size();
+    }
+
+    return total;
+}
+
+// Each layer encoded once per update (see get_encoded_layer), each client's frame assembled from those
+size_t serialize_shared(const std::vector<Bench_Layer> &layers, int num_clients, std::vector<Frame_Writer> &encoded, Frame_Writer &frame) {
+    encoded.resize(layers.size());
+
+    for (int l = 0; l < layers.size(); l++) {
+        encoded[l].clear();
+
+        encode_layer(encoded[l], layers[l]);
+    }
+
+    size_t total = 0;
+
+    for (int c = 0; c < num_clients; c++) {
+        frame.clear();
+
+        frame.add(sizeof(Frame_Header));
+
+        frame.push<std::uint32_t>(1);
+
+        for (int l = 0; l < layers.size(); l++)
+            frame.push_bytes(encoded[l].get_data(), encoded[l].get_size());
+
+        total += frame.get_size();
+    }
+
+    return total;
+}
+
+void bench_serialize() {
+    const int num_layers = 8;
+    const int size = 64;
+    const int column_size = 32;
+    const int num_updates = 2000;
+
+    std::vector<Bench_Layer> layers = make_hierarchy(num_layers, size, size, column_size, 1);
+
+    std::printf("serialize: %d layers of %dx%dx%d, us per update (median of 5 runs of %d updates)\n", num_layers, size, size, column_size, num_updates);
+    std::printf("%8s %14s %14s %14s\n", "clients", "before", "packed", "shared");
+
+    const int client_counts[] = { 1, 2, 5, 10 };
+
+    double first[3];
+    double last[3];
+
+    std::vector<Frame_Writer> encoded;
+    Frame_Writer frame;
+
+    size_t sink = 0;
+
+    for (int n = 0; n < 4; n++) {
+        int num_clients = client_counts[n];
+
+        double times[3];
+
+        for (int method = 0; method < 3; method++) {
+            std::vector<double> runs;
+
+            for (int run = 0; run < 5; run++) {
+                bench_clock::time_point start = bench_clock::now();
+
+                for (int u = 0; u < num_updates; u++) {
+                    if (method == 0)
+                        sink += serialize_per_client(layers, num_clients);
+                    else if (method == 1)
+                        sink += serialize_packed_per_client(layers, num_clients, frame);
+                    else
+                        sink += serialize_shared(layers, num_clients, encoded, frame);
+                }
+
+                runs.push_back(seconds_since(start) * 1e6 / num_updates);
+            }
+
+            std::sort(runs.begin(), runs.end());
+
+            times[method] = runs[runs.size() / 2];
+        }
+
+        std::printf("%8d %14.1f %14.1f %14.1f\n", num_clients, times[0], times[1], times[2]);
+
+        for (int method = 0; method < 3; method++) {
+            if (n == 0)
+                first[method] = times[method];
+
+            last[method] = times[method];
+        }
+    }
+
+    std::printf("per extra client: before %.1f us, packed %.1f us, shared %.1f us\n",
+        (last[0] - first[0]) / 9.0, (last[1] - first[1]) / 9.0, (last[2] - first[2]) / 9.0);
+
+    // Keeps the work from being optimized away
+    if (sink == 0)
+        std::printf("\n");
+}
+
+// ----------------------------- Parse ------------------------------
+
+#ifdef NEOVIS_BENCH_SOCKETS
+// A connected pair of loopback TCP sockets, false if the system has none to give
+bool open_loopback(int &sender, int &receiver) {
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+
+    sockaddr_in address;
+    std::memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = 0;
+
+    socklen_t address_size = sizeof(address);
+
+    if (listener == -1 || bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 || listen(listener, 1) != 0 ||
+        getsockname(listener, reinterpret_cast<sockaddr*>(&address), &address_size) != 0) {
+        if (listener != -1)
+            close(listener);
+
+        return false;
+    }
+
+    sender = socket(AF_INET, SOCK_STREAM, 0);
+
+    bool connected = sender != -1 && connect(sender, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == 0;
+
+    receiver = connected ? accept(listener, nullptr, nullptr) : -1;
+
+    close(listener);
+
+    if (receiver == -1) {
+        if (sender != -1)
+            close(sender);
+
+        return false;
+    }
+
+    // Like SFML's sockets
+    int no_delay = 1;
+
+    setsockopt(sender, IPPROTO_TCP, TCP_NODELAY, &no_delay, sizeof(no_delay));
+    setsockopt(receiver, IPPROTO_TCP, TCP_NODELAY, &no_delay, sizeof(no_delay));
+
+    return true;
+}
+
+bool send_all(int socket, const unsigned char* data, size_t size) {
+    while (size > 0) {
+        ssize_t sent = send(socket, data, size, 0);
+
+        if (sent <= 0)
+            return false;
+
+        data += sent;
+        size -= sent;
+    }
+
+    return true;
+}
+
+bool recv_all(int socket, unsigned char* data, size_t size) {
+    while (size > 0) {
+        ssize_t received = recv(socket, data, size, 0);
+
+        if (received <= 0)
+            return false;
+
+        data += received;
+        size -= received;
+    }
+
+    return true;
+}
+#endif
+
+// Header filled in for a finished frame
+void finish_frame(Frame_Writer &frame, std::uint8_t type, std::uint32_t sequence) {
+    Frame_Header header;
+    header.magic = frame_magic;
+    header.version = protocol_version;
+    header.type = type;
+    header.flags = 0;
+    header.sequence = sequence;
+    header.size = static_cast<std::uint32_t>(frame.get_size() - sizeof(Frame_Header));
+    header.timestamp = 0;
+
+    std::memcpy(frame.get_data(), &header, sizeof(Frame_Header));
+}
+
+// Layer as push_csdr writes it without compression: changed columns against base while that is smaller, packed in full otherwise
+void encode_layer_delta(Frame_Writer &writer, const Bench_Layer &layer, const Bench_Layer* base) {
+    int num_columns = layer.cis.size();
+
+    int index_bits = bits_for(layer.column_size);
+    int column_bits = bits_for(num_columns);
+
+    std::vector<int> changed_columns;
+    std::vector<int> changed_indices;
+
+    bool full = base == nullptr;
+
+    if (!full) {
+        for (int i = 0; i < num_columns; i++) {
+            if (layer.cis[i] != base->cis[i]) {
+                changed_columns.push_back(i);
+                changed_indices.push_back(layer.cis[i]);
+            }
+        }
+
+        size_t num_changed = changed_columns.size();
+
+        full = max_varint_size + packed_size(num_changed, column_bits) + packed_size(num_changed, index_bits) >= packed_size(num_columns, index_bits);
+    }
+
+    if (full) {
+        encode_layer(writer, layer);
+
+        return;
+    }
+
+    size_t num_changed = changed_columns.size();
+
+    writer.push<std::uint8_t>(csdr_encoding_delta);
+
+    writer.push_varint(static_cast<std::uint32_t>(num_changed));
+
+    pack_bits(changed_columns.data(), num_changed, column_bits, writer.add(packed_size(num_changed, column_bits)));
+    pack_bits(changed_indices.data(), num_changed, index_bits, writer.add(packed_size(num_changed, index_bits)));
+}
+
+// num_states states of an evolving hierarchy, each changing a share of its columns, with a keyframe every keyframe_interval
+std::vector<std::vector<unsigned char>> make_state_stream(std::vector<Bench_Layer> layers, int num_states, float change, int keyframe_interval) {
+    std::mt19937 rng(2);
+
+    std::uniform_real_distribution<float> chance(0.0f, 1.0f);
+
+    std::vector<std::vector<unsigned char>> stream(num_states);
+
+    std::vector<Bench_Layer> previous = layers;
+
+    Frame_Writer frame;
+
+    for (int f = 0; f < num_states; f++) {
+        for (int l = 0; l < layers.size(); l++) {
+            std::uniform_int_distribution<int> cell(0, layers[l].column_size - 1);
+
+            for (int i = 0; i < layers[l].cis.size(); i++) {
+                if (chance(rng) < change)
+                    layers[l].cis[i] = cell(rng);
+            }
+        }
+
+        frame.clear();
+
+        frame.add(sizeof(Frame_Header));
+
+        frame.push<std::uint32_t>(1);
+
+        for (int l = 0; l < layers.size(); l++)
+            encode_layer_delta(frame, layers[l], f % keyframe_interval == 0 ? nullptr : &previous[l]);
+
+        finish_frame(frame, message_state, f);
+
+        stream[f].assign(frame.get_data(), frame.get_data() + frame.get_size());
+
+        previous = layers;
+    }
+
+    return stream;
+}
+
+// How the viewer held layers before they were shared: every copy of the network owns its own
+struct Owned_Network {
+    std::vector<std::vector<std::int32_t>> csdrs;
+};
+
+// How it holds them now (see CSDR): copies share immutable buffers
+struct Shared_Network {
+    std::vector<std::shared_ptr<const std::vector<std::int32_t>>> csdrs;
+};
+
+// Decoded layer buffers, reused once no copy of the network refers to them (see acquire_indices)
+struct Indices_Pool {
+    std::vector<std::shared_ptr<std::vector<std::int32_t>>> buffers;
+
+    std::shared_ptr<std::vector<std::int32_t>> acquire() {
+        for (int i = 0; i < buffers.size(); i++) {
+            if (buffers[i].use_count() == 1)
+                return buffers[i];
+        }
+
+        buffers.push_back(std::make_shared<std::vector<std::int32_t>>());
+
+        return buffers.back();
+    }
+};
+
+// Reads a delta's changed columns and their indices, false if malformed
+bool read_delta(Frame_Reader &reader, const Bench_Layer &desc, std::vector<int> &columns, std::vector<int> &indices) {
+    size_t num_columns = desc.cis.size();
+
+    int index_bits = bits_for(desc.column_size);
+    int column_bits = bits_for(num_columns);
+
+    std::uint32_t num_changed = reader.read_varint();
+
+    if (!reader.is_valid() || num_changed > num_columns)
+        return false;
+
+    const unsigned char* packed_columns = reader.skip(packed_size(num_changed, column_bits));
+    const unsigned char* packed_indices = reader.skip(packed_size(num_changed, index_bits));
+
+    if (packed_columns == nullptr || packed_indices == nullptr)
+        return false;
+
+    columns.resize(num_changed);
+    indices.resize(num_changed);
+
+    unpack_bits(packed_columns, num_changed, column_bits, columns.data());
+    unpack_bits(packed_indices, num_changed, index_bits, indices.data());
+
+    for (int i = 0; i < num_changed; i++) {
+        if (columns[i] >= num_columns)
+            return false;
+    }
+
+    return true;
+}
+
+// Decodes into the network's own vectors, patching deltas in place
+bool parse_owned(const unsigned char* body, size_t size, const std::vector<Bench_Layer> &descs, Owned_Network &net, std::vector<int> &columns, std::vector<int> &indices) {
+    Frame_Reader reader(body, size);
+
+    reader.read<std::uint32_t>();
+
+    net.csdrs.resize(descs.size());
+
+    for (int l = 0; l < descs.size(); l++) {
+        std::vector<std::int32_t> &csdr = net.csdrs[l];
+
+        size_t num_columns = descs[l].cis.size();
+
+        std::uint8_t encoding = reader.read<std::uint8_t>();
+
+        if (encoding == csdr_encoding_packed) {
+            int index_bits = bits_for(descs[l].column_size);
+
+            const unsigned char* packed = reader.skip(packed_size(num_columns, index_bits));
+
+            if (packed == nullptr)
+                return false;
+
+            csdr.resize(num_columns);
+
+            unpack_bits(packed, num_columns, index_bits, csdr.data());
+        }
+        else if (encoding == csdr_encoding_delta) {
+            if (csdr.size() != num_columns || !read_delta(reader, descs[l], columns, indices))
+                return false;
+
+            for (int i = 0; i < columns.size(); i++)
+                csdr[columns[i]] = indices[i];
+        }
+        else
+            return false;
+    }
+
+    return reader.is_valid();
+}
+
+// Decodes into pooled buffers, deltas patching a fresh copy of the layer they change
+bool parse_shared(const unsigned char* body, size_t size, const std::vector<Bench_Layer> &descs, Shared_Network &net, Indices_Pool &pool,
+    std::vector<int> &columns, std::vector<int> &indices)
+{
+    Frame_Reader reader(body, size);
+
+    reader.read<std::uint32_t>();
+
+    net.csdrs.resize(descs.size());
+
+    for (int l = 0; l < descs.size(); l++) {
+        size_t num_columns = descs[l].cis.size();
+
+        std::uint8_t encoding = reader.read<std::uint8_t>();
+
+        if (encoding == csdr_encoding_packed) {
+            int index_bits = bits_for(descs[l].column_size);
+
+            const unsigned char* packed = reader.skip(packed_size(num_columns, index_bits));
+
+            if (packed == nullptr)
+                return false;
+
+            std::shared_ptr<std::vector<std::int32_t>> decoded = pool.acquire();
+
+            decoded->resize(num_columns);
+
+            unpack_bits(packed, num_columns, index_bits, decoded->data());
+
+            net.csdrs[l] = decoded;
+        }
+        else if (encoding == csdr_encoding_delta) {
+            if (net.csdrs[l] == nullptr || net.csdrs[l]->size() != num_columns || !read_delta(reader, descs[l], columns, indices))
+                return false;
+
+            std::shared_ptr<std::vector<std::int32_t>> patched = pool.acquire();
+
+            *patched = *net.csdrs[l];
+
+            for (int i = 0; i < columns.size(); i++)
+                (*patched)[columns[i]] = indices[i];
+
+            net.csdrs[l] = patched;
+        }
+        else
+            return false;
+    }
+
+    return reader.is_valid();
+}
+
+// Either layout's layer, for checking both decoded the same
+const std::vector<std::int32_t>* get_indices(const std::vector<std::int32_t> &indices) {
+    return &indices;
+}
+
+const std::vector<std::int32_t>* get_indices(const std::shared_ptr<const std::vector<std::int32_t>> &indices) {
+    return indices.get();
+}
+
+// Receives, parses and publishes states the way the viewer's receive thread does, then takes the main loop's copy.
+// Returns the sum of the shown indices, the same for both layouts if they decoded the same
+template<class Network, class Parse>
+std::uint64_t receive_states(const std::vector<std::vector<unsigned char>> &stream, int repeats, int source, Parse parse, double &seconds) {
+    Network received;
+    Network buffered;
+    Network shown;
+
+    std::vector<unsigned char> body;
+
+    bench_clock::time_point start = bench_clock::now();
+
+    for (int r = 0; r < repeats; r++) {
+        for (int f = 0; f < stream.size(); f++) {
+            Frame_Header header;
+
+            const unsigned char* data;
+
+#ifdef NEOVIS_BENCH_SOCKETS
+            if (source != -1) {
+                if (!recv_all(source, reinterpret_cast<unsigned char*>(&header), sizeof(Frame_Header)))
+                    return 0;
+
+                body.resize(header.size);
+
+                if (!recv_all(source, body.data(), header.size))
+                    return 0;
+
+                data = body.data();
+            }
+            else
+#endif
+            {
+                std::memcpy(&header, stream[f].data(), sizeof(Frame_Header));
+
+                data = stream[f].data() + sizeof(Frame_Header);
+            }
+
+            if (!parse(data, header.size, received))
+                return 0;
+
+            // Published for the main loop, which takes its copy to show
+            buffered = received;
+
+            shown = buffered;
+        }
+    }
+
+    seconds = seconds_since(start);
+
+    std::uint64_t sum = 0;
+
+    for (int l = 0; l < shown.csdrs.size(); l++) {
+        for (int i = 0; i < 64; i++)
+            sum += (*get_indices(shown.csdrs[l]))[i];
+    }
+
+    return sum;
+}
+
+// One run, over loopback sockets with a thread sending the stream or straight from memory. False if it could not be run or parsing failed
+template<class Parse_Owned, class Parse_Shared>
+bool receive_run(const std::vector<std::vector<unsigned char>> &stream, int repeats, bool loopback, bool shared, Parse_Owned parse_owned_state,
+    Parse_Shared parse_shared_state, std::uint64_t &sum, double &seconds)
+{
+    int sender = -1;
+    int receiver = -1;
+
+    std::unique_ptr<std::thread> send_thread;
+
+    if (loopback) {
+#ifdef NEOVIS_BENCH_SOCKETS
+        if (!open_loopback(sender, receiver))
+            return false;
+
+        send_thread.reset(new std::thread([&stream, sender, repeats]() {
+            for (int r = 0; r < repeats; r++) {
+                for (int f = 0; f < stream.size(); f++)
+                    send_all(sender, stream[f].data(), stream[f].size());
+            }
+        }));
+#else
+        return false;
+#endif
+    }
+
+    sum = shared ? receive_states<Shared_Network>(stream, repeats, receiver, parse_shared_state, seconds) :
+        receive_states<Owned_Network>(stream, repeats, receiver, parse_owned_state, seconds);
+
+#ifdef NEOVIS_BENCH_SOCKETS
+    if (send_thread != nullptr) {
+        // Unblocks the sender should parsing have stopped early
+        shutdown(receiver, SHUT_RDWR);
+
+        send_thread->join();
+
+        close(sender);
+        close(receiver);
+    }
+#endif
+
+    return sum != 0;
+}
+
+void bench_parse() {
+    const int num_layers = 8;
+    const int size = 64;
+    const int column_size = 32;
+    const int num_states = 300;
+    const int repeats = 10;
+
+    std::vector<Bench_Layer> descs = make_hierarchy(num_layers, size, size, column_size, 1);
+
+    std::vector<std::vector<unsigned char>> stream = make_state_stream(descs, num_states, 0.05f, 30);
+
+    size_t stream_size = 0;
+
+    for (int f = 0; f < stream.size(); f++)
+        stream_size += stream[f].size();
+
+    std::printf("parse: %d layers of %dx%dx%d, 5%% of columns changing per state, keyframe every 30, %.1f KB per state on average\n",
+        num_layers, size, size, column_size, stream_size / 1024.0 / num_states);
+
+    std::vector<int> columns;
+    std::vector<int> indices;
+
+    Indices_Pool pool;
+
+    auto parse_owned_state = [&](const unsigned char* body, size_t body_size, Owned_Network &net) {
+        return parse_owned(body, body_size, descs, net, columns, indices);
+    };
+
+    auto parse_shared_state = [&](const unsigned char* body, size_t body_size, Shared_Network &net) {
+        return parse_shared(body, body_size, descs, net, pool, columns, indices);
+    };
+
+    std::printf("%10s %16s %16s %16s   (median of 5 runs of %d states)\n", "source", "layout", "us per state", "MB/s", num_states * repeats);
+
+    for (int loopback = 0; loopback < 2; loopback++) {
+        for (int shared = 0; shared < 2; shared++) {
+            std::vector<double> runs;
+
+            std::uint64_t sum = 0;
+
+            for (int run = 0; run < 5; run++) {
+                double seconds = 0.0;
+
+                if (!receive_run(stream, repeats, loopback != 0, shared != 0, parse_owned_state, parse_shared_state, sum, seconds)) {
+                    std::printf("%10s could not be run\n", loopback ? "loopback" : "memory");
+
+                    return;
+                }
+
+                runs.push_back(seconds);
+            }
+
+            std::sort(runs.begin(), runs.end());
+
+            double seconds = runs[runs.size() / 2];
+
+            std::printf("%10s %16s %16.1f %16.1f   (check %llu)\n", loopback ? "loopback" : "memory", shared ? "shared" : "owned copies",
+                seconds * 1e6 / (num_states * repeats), stream_size * repeats / seconds / 1e6, static_cast<unsigned long long>(sum));
+        }
+    }
+}
+
+// ---------------------------- Latency -----------------------------
+
+#ifdef NEOVIS_BENCH_SOCKETS
+std::uint64_t micros_now() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(bench_clock::now().time_since_epoch()).count();
+}
+
+// Fields of a cell, one per visible layer, each sent in full and raw as push_fields does for a new caret
+void push_bench_fields(Frame_Writer &writer, int num_fields, int diam, int depth, const std::vector<unsigned char> &weights) {
+    writer.push_varint(0);
+    writer.push_varint(num_fields);
+
+    for (int f = 0; f < num_fields; f++) {
+        writer.push<std::uint8_t>(field_changed);
+
+        writer.push_varint(diam);
+        writer.push_varint(diam);
+        writer.push_varint(depth);
+
+        writer.push<std::uint8_t>(field_encoding_raw);
+
+        writer.push_bytes(weights.data(), diam * diam * depth);
+    }
+}
+
+// Reads fields written by push_bench_fields into fields, false if malformed
+bool parse_bench_fields(Frame_Reader &reader, std::vector<std::vector<unsigned char>> &fields) {
+    reader.read_varint();
+
+    std::uint32_t num_fields = reader.read_varint();
+
+    if (!reader.is_valid() || num_fields > 64)
+        return false;
+
+    fields.resize(num_fields);
+
+    for (int f = 0; f < num_fields; f++) {
+        reader.read<std::uint8_t>();
+
+        size_t size = static_cast<size_t>(reader.read_varint()) * reader.read_varint() * reader.read_varint();
+
+        reader.read<std::uint8_t>();
+
+        const unsigned char* weights = reader.skip(size);
+
+        if (weights == nullptr)
+            return false;
+
+        fields[f].assign(weights, weights + size);
+    }
+
+    return reader.is_valid();
+}
+
+struct Latency_Setup {
+    std::vector<Bench_Layer> layers;
+
+    int num_fields;
+    int field_diam;
+    int field_depth;
+
+    // Fields go out ahead of the state in their own message, rather than at the end of it
+    bool fields_first;
+
+    bench_clock::duration update_interval;
+};
+
+// The adapter: an update every update_interval, answering the latest caret (a 32-bit id after the command header) on the next one
+void latency_adapter(const Latency_Setup &setup, int socket, std::atomic<bool> &stopping) {
+    Frame_Writer state;
+    Frame_Writer fields;
+
+    std::vector<unsigned char> weights(setup.field_diam * setup.field_diam * setup.field_depth, 128);
+
+    std::uint32_t sequence = 0;
+
+    bench_clock::time_point next_update = bench_clock::now();
+
+    while (!stopping) {
+        std::this_thread::sleep_until(next_update);
+
+        next_update += setup.update_interval;
+
+        std::uint64_t timestamp = micros_now();
+
+        // Newest caret since the last update, if any
+        bool new_caret = false;
+
+        std::uint32_t caret_id = 0;
+
+        unsigned char command[sizeof(Command_Header) + sizeof(std::uint32_t)];
+
+        while (recv(socket, command, sizeof(command), MSG_DONTWAIT) == sizeof(command)) {
+            std::memcpy(&caret_id, command + sizeof(Command_Header), sizeof(std::uint32_t));
+
+            new_caret = true;
+        }
+
+        if (new_caret && setup.fields_first) {
+            fields.clear();
+
+            fields.add(sizeof(Frame_Header));
+
+            fields.push<std::uint32_t>(1);
+            fields.push<std::uint32_t>(caret_id);
+
+            push_bench_fields(fields, setup.num_fields, setup.field_diam, setup.field_depth, weights);
+
+            finish_frame(fields, message_fields, sequence++);
+
+            std::memcpy(fields.get_data() + offsetof(Frame_Header, timestamp), &timestamp, sizeof(std::uint64_t));
+
+            if (!send_all(socket, fields.get_data(), fields.get_size()))
+                return;
+        }
+
+        state.clear();
+
+        state.add(sizeof(Frame_Header));
+
+        state.push<std::uint32_t>(1);
+
+        for (int l = 0; l < setup.layers.size(); l++)
+            encode_layer(state, setup.layers[l]);
+
+        // As the state used to carry the caret's fields after every layer
+        if (!setup.fields_first) {
+            state.push<std::uint32_t>(new_caret ? caret_id : 0);
+
+            push_bench_fields(state, new_caret ? setup.num_fields : 0, setup.field_diam, setup.field_depth, weights);
+        }
+
+        finish_frame(state, message_state, sequence++);
+
+        std::memcpy(state.get_data() + offsetof(Frame_Header, timestamp), &timestamp, sizeof(std::uint64_t));
+
+        if (!send_all(socket, state.get_data(), state.get_size()))
+            return;
+    }
+}
+
+// The viewer: reads and parses everything the adapter sends, clicking every so often.
+// Fills in, per click, the time from clicking to having its fields parsed, and from the adapter's answering update to that
+bool latency_viewer(const Latency_Setup &setup, int socket, int num_clicks, std::vector<double> &click_times, std::vector<double> &answer_times) {
+    std::mt19937 rng(3);
+
+    // Clicks land anywhere between updates
+    std::uniform_int_distribution<int> click_delay(5000, 40000);
+
+    std::vector<std::vector<std::int32_t>> csdrs(setup.layers.size());
+    std::vector<std::vector<unsigned char>> fields;
+
+    std::vector<unsigned char> body;
+
+    std::uint32_t caret_id = 0;
+
+    bool clicked = false;
+
+    bench_clock::time_point click_time;
+    bench_clock::time_point next_click = bench_clock::now() + std::chrono::microseconds(click_delay(rng));
+
+    while (click_times.size() < num_clicks) {
+        if (!clicked && bench_clock::now() >= next_click) {
+            caret_id++;
+
+            unsigned char command[sizeof(Command_Header) + sizeof(std::uint32_t)];
+
+            Command_Header header;
+            header.size = sizeof(std::uint32_t);
+            header.type = command_set_caret;
+            header.reserved = 0;
+
+            std::memcpy(command, &header, sizeof(Command_Header));
+            std::memcpy(command + sizeof(Command_Header), &caret_id, sizeof(std::uint32_t));
+
+            click_time = bench_clock::now();
+
+            if (!send_all(socket, command, sizeof(command)))
+                return false;
+
+            clicked = true;
+        }
+
+        int timeout = clicked ? 100 : std::max(0, static_cast<int>(std::chrono::duration_cast<std::chrono::milliseconds>(next_click - bench_clock::now()).count()));
+
+        pollfd readable;
+        readable.fd = socket;
+        readable.events = POLLIN;
+        readable.revents = 0;
+
+        if (poll(&readable, 1, timeout) <= 0)
+            continue;
+
+        Frame_Header header;
+
+        if (!recv_all(socket, reinterpret_cast<unsigned char*>(&header), sizeof(Frame_Header)))
+            return false;
+
+        body.resize(header.size);
+
+        if (!recv_all(socket, body.data(), header.size))
+            return false;
+
+        Frame_Reader reader(body.data(), body.size());
+
+        reader.read<std::uint32_t>();
+
+        std::uint32_t answered = 0;
+
+        if (header.type == message_state) {
+            for (int l = 0; l < setup.layers.size(); l++) {
+                size_t num_columns = setup.layers[l].cis.size();
+
+                int index_bits = bits_for(setup.layers[l].column_size);
+
+                reader.read<std::uint8_t>();
+
+                const unsigned char* packed = reader.skip(packed_size(num_columns, index_bits));
+
+                if (packed == nullptr)
+                    return false;
+
+                csdrs[l].resize(num_columns);
+
+                unpack_bits(packed, num_columns, index_bits, csdrs[l].data());
+            }
+
+            if (!setup.fields_first) {
+                answered = reader.read<std::uint32_t>();
+
+                if (!parse_bench_fields(reader, fields))
+                    return false;
+            }
+        }
+        else if (header.type == message_fields) {
+            answered = reader.read<std::uint32_t>();
+
+            if (!parse_bench_fields(reader, fields))
+                return false;
+        }
+
+        if (clicked && answered == caret_id) {
+            click_times.push_back(std::chrono::duration<double, std::milli>(bench_clock::now() - click_time).count());
+            answer_times.push_back((micros_now() - header.timestamp) / 1000.0);
+
+            clicked = false;
+
+            next_click = bench_clock::now() + std::chrono::microseconds(click_delay(rng));
+        }
+    }
+
+    return true;
+}
+#endif
+
+void bench_latency() {
+#ifdef NEOVIS_BENCH_SOCKETS
+    const int num_clicks = 100;
+
+    std::printf("latency: click to fields parsed over loopback, adapter updating at 60 Hz, %d clicks each, ms (target 16.7)\n", num_clicks);
+    std::printf("%24s %14s %10s %10s %10s %10s\n", "hierarchy", "fields", "click p50", "click p95", "answer p50", "answer p95");
+
+    for (int big = 0; big < 2; big++) {
+        for (int fields_first = 0; fields_first < 2; fields_first++) {
+            Latency_Setup setup;
+            setup.layers = big ? make_hierarchy(16, 256, 256, 64, 1) : make_hierarchy(8, 64, 64, 32, 1);
+            setup.num_fields = 4;
+            setup.field_diam = 9;
+            setup.field_depth = 32;
+            setup.fields_first = fields_first != 0;
+            setup.update_interval = std::chrono::microseconds(16667);
+
+            int adapter = -1;
+            int viewer = -1;
+
+            if (!open_loopback(adapter, viewer)) {
+                std::printf("latency: could not open loopback sockets\n");
+
+                return;
+            }
+
+            std::atomic<bool> stopping(false);
+
+            std::thread adapter_thread(latency_adapter, std::cref(setup), adapter, std::ref(stopping));
+
+            std::vector<double> click_times;
+            std::vector<double> answer_times;
+
+            bool ok = latency_viewer(setup, viewer, num_clicks, click_times, answer_times);
+
+            stopping = true;
+
+            shutdown(viewer, SHUT_RDWR);
+
+            adapter_thread.join();
+
+            close(adapter);
+            close(viewer);
+
+            if (!ok) {
+                std::printf("latency: viewer failed\n");
+
+                return;
+            }
+
+            std::sort(click_times.begin(), click_times.end());
+            std::sort(answer_times.begin(), answer_times.end());
+
+            char hierarchy[64];
+
+            std::snprintf(hierarchy, sizeof(hierarchy), "%dx%dx%dx%d (%.0f KB)", static_cast<int>(setup.layers.size()), setup.layers[0].width,
+                setup.layers[0].height, setup.layers[0].column_size,
+                setup.layers.size() * (1 + packed_size(setup.layers[0].cis.size(), bits_for(setup.layers[0].column_size))) / 1024.0);
+
+            std::printf("%24s %14s %10.2f %10.2f %10.2f %10.2f\n", hierarchy, fields_first ? "ahead" : "after layers",
+                click_times[num_clicks / 2], click_times[num_clicks * 95 / 100], answer_times[num_clicks / 2], answer_times[num_clicks * 95 / 100]);
+        }
+    }
+#else
+    std::printf("latency: needs POSIX sockets, skipped\n");
+#endif
+}
+
+int main(int argc, char* argv[]) {
+    std::string section = argc > 1 ? argv[1] : "";
+
+    if (section.empty() || section == "serialize")
+        bench_serialize();
+
+    if (section.empty() || section == "parse")
+        bench_parse();
+
+    if (section.empty() || section == "latency")
+        bench_latency();
+
+    return 0;
+}
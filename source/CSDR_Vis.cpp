@@ -105,13 +105,13 @@ void CSDR_Vis::draw_column(const sf::Vector2f &position, int index, bool isOdd,
         }
 }
 
-void CSDR_Vis::draw() {
+void CSDR_Vis::draw(const sf::Vector2i &lower, const sf::Vector2i &upper) {
     rt->clear(sf::Color::Transparent);
 
     float r_size = node_space_size * root_column_size;
 
-    for (int x = 0; x < width; x++)
-        for (int y = 0; y < height; y++)
+    for (int x = lower.x; x < upper.x; x++)
+        for (int y = lower.y; y < upper.y; y++)
             draw_column(sf::Vector2f(x * r_size, y * r_size), at(x, y), x % 2 != y % 2, x, y);
 
     rt->display();
@@ -64,7 +64,12 @@ public:
         return columns[y + x * height];
     }
 
-    void draw();
+    // Draws the columns from lower up to (not including) upper, leaving the rest of the texture clear
+    void draw(const sf::Vector2i &lower, const sf::Vector2i &upper);
+
+    void draw() {
+        draw(sf::Vector2i(0, 0), sf::Vector2i(width, height));
+    }
 
     sf::Vector2i get_size_in_nodes() const {
         return sf::Vector2i(width * root_column_size, height * root_column_size);
@@ -74,6 +79,13 @@ public:
         return rt->getTexture();
     }
 
+    // Column and cell of the node at (x, y), counted in nodes like highlight_x/y. Z is -1 where the column has no such cell
+    sf::Vector3i get_CSDR_pos(int x, int y) const {
+        int z = x % root_column_size + (y % root_column_size) * root_column_size;
+
+        return sf::Vector3i(x / root_column_size, y / root_column_size, z < column_size ? z : -1);
+    }
+
     const sf::Vector3i &get_highlighted_CSDR_pos() const {
         return highlighted_CSDR_pos;
     }
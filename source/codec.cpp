@@ -0,0 +1,178 @@
+// ----------------------------------------------------------------------------
+//  NeoVis
+//  Copyright(c) 2017-2024 Ogma Intelligent Systems Corp. All rights reserved.
+//
+//  This copy of NeoVis is licensed to you under the terms described
+//  in the NEOVIS_LICENSE.md file included in this distribution.
+// ----------------------------------------------------------------------------
+
+#include "codec.h"
+
+#include <cstring>
+
+const size_t lz_min_match = 4;
+const size_t lz_max_offset = 65535;
+const int lz_hash_bits = 12;
+
+const std::uint32_t lz_no_position = 0xffffffff;
+
+std::uint32_t lz_read32(const unsigned char* p) {
+    std::uint32_t value;
+
+    std::memcpy(&value, p, sizeof(std::uint32_t));
+
+    return value;
+}
+
+std::uint32_t lz_hash(std::uint32_t value) {
+    return (value * 2654435761u) >> (32 - lz_hash_bits);
+}
+
+// Lengths that saturate their 4-bit token field continue in 255-valued bytes
+void lz_push_length(std::vector<unsigned char> &dst, size_t length) {
+    while (length >= 255) {
+        dst.push_back(255);
+
+        length -= 255;
+    }
+
+    dst.push_back(static_cast<unsigned char>(length));
+}
+
+bool lz_read_length(const unsigned char* &src, const unsigned char* end, size_t &length) {
+    unsigned char b;
+
+    do {
+        if (src >= end)
+            return false;
+
+        b = *src++;
+
+        length += b;
+    } while (b == 255);
+
+    return true;
+}
+
+// match_length 0 marks the final, literals-only sequence
+void lz_push_sequence(
+    std::vector<unsigned char> &dst,
+    const unsigned char* literals,
+    size_t num_literals,
+    size_t match_length,
+    size_t offset
+) {
+    size_t match_code = match_length > 0 ? match_length - lz_min_match : 0;
+
+    dst.push_back(static_cast<unsigned char>(((num_literals < 15 ? num_literals : 15) << 4) | (match_code < 15 ? match_code : 15)));
+
+    if (num_literals >= 15)
+        lz_push_length(dst, num_literals - 15);
+
+    dst.insert(dst.end(), literals, literals + num_literals);
+
+    if (match_length > 0) {
+        dst.push_back(static_cast<unsigned char>(offset & 0xff));
+        dst.push_back(static_cast<unsigned char>(offset >> 8));
+
+        if (match_code >= 15)
+            lz_push_length(dst, match_code - 15);
+    }
+}
+
+void lz_compress(
+    const unsigned char* src,
+    size_t size,
+    std::vector<unsigned char> &dst
+) {
+    std::uint32_t table[1 << lz_hash_bits];
+
+    for (int i = 0; i < (1 << lz_hash_bits); i++)
+        table[i] = lz_no_position;
+
+    size_t anchor = 0;
+    size_t pos = 0;
+
+    while (pos + lz_min_match <= size) {
+        std::uint32_t sequence = lz_read32(&src[pos]);
+        std::uint32_t h = lz_hash(sequence);
+
+        std::uint32_t candidate = table[h];
+
+        table[h] = static_cast<std::uint32_t>(pos);
+
+        if (candidate != lz_no_position && pos - candidate <= lz_max_offset && lz_read32(&src[candidate]) == sequence) {
+            size_t length = lz_min_match;
+
+            // May overlap the current position, which is how runs get encoded
+            while (pos + length < size && src[candidate + length] == src[pos + length])
+                length++;
+
+            lz_push_sequence(dst, &src[anchor], pos - anchor, length, pos - candidate);
+
+            pos += length;
+            anchor = pos;
+        }
+        else
+            pos++;
+    }
+
+    lz_push_sequence(dst, &src[anchor], size - anchor, 0, 0);
+}
+
+bool lz_decompress(
+    const unsigned char* src,
+    size_t size,
+    unsigned char* dst,
+    size_t dst_size
+) {
+    const unsigned char* end = src + size;
+
+    size_t out = 0;
+
+    while (src < end) {
+        unsigned char token = *src++;
+
+        size_t num_literals = token >> 4;
+
+        if (num_literals == 15 && !lz_read_length(src, end, num_literals))
+            return false;
+
+        if (num_literals > static_cast<size_t>(end - src) || num_literals > dst_size - out)
+            return false;
+
+        std::memcpy(&dst[out], src, num_literals);
+
+        src += num_literals;
+        out += num_literals;
+
+        // Final sequence carries no match
+        if (out == dst_size)
+            return src == end;
+
+        if (end - src < 2)
+            return false;
+
+        size_t offset = static_cast<size_t>(src[0]) | (static_cast<size_t>(src[1]) << 8);
+
+        src += 2;
+
+        size_t length = token & 15;
+
+        if (length == 15 && !lz_read_length(src, end, length))
+            return false;
+
+        length += lz_min_match;
+
+        if (offset == 0 || offset > out || length > dst_size - out)
+            return false;
+
+        // Byte by byte since the source may overlap what is being written
+        for (size_t i = 0; i < length; i++)
+            dst[out + i] = dst[out - offset + i];
+
+        out += length;
+    }
+
+    return out == dst_size;
+}
@@ -0,0 +1,154 @@
+// ----------------------------------------------------------------------------
+//  NeoVis
+//  Copyright(c) 2017-2024 Ogma Intelligent Systems Corp. All rights reserved.
+//
+//  This copy of NeoVis is licensed to you under the terms described
+//  in the NEOVIS_LICENSE.md file included in this distribution.
+// ----------------------------------------------------------------------------
+
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+// Number of bits needed to store any value in [0, count)
+inline int bits_for(std::uint64_t count) {
+    int bits = 0;
+
+    while (bits < 32 && (static_cast<std::uint64_t>(1) << bits) < count)
+        bits++;
+
+    return bits;
+}
+
+inline size_t packed_size(size_t num_values, int bits) {
+    return (num_values * bits + 7) / 8;
+}
+
+// Packs values LSB first into consecutive bits, dst must hold packed_size(num_values, bits) bytes
+template<class T>
+void pack_bits(
+    const T* values,
+    size_t num_values,
+    int bits,
+    unsigned char* dst
+) {
+    if (bits == 0)
+        return;
+
+    // Byte-aligned widths get plain narrowing loops the compiler can vectorize
+    if (bits == 8) {
+        for (size_t i = 0; i < num_values; i++)
+            dst[i] = static_cast<unsigned char>(values[i]);
+
+        return;
+    }
+
+    if (bits == 16) {
+        for (size_t i = 0; i < num_values; i++) {
+            dst[i * 2] = static_cast<unsigned char>(values[i]);
+            dst[i * 2 + 1] = static_cast<unsigned char>(static_cast<std::uint32_t>(values[i]) >> 8);
+        }
+
+        return;
+    }
+
+    if (bits == 4) {
+        size_t num_pairs = num_values / 2;
+
+        for (size_t i = 0; i < num_pairs; i++)
+            dst[i] = static_cast<unsigned char>((values[i * 2] & 0xf) | ((values[i * 2 + 1] & 0xf) << 4));
+
+        if (num_values % 2 != 0)
+            dst[num_pairs] = static_cast<unsigned char>(values[num_values - 1] & 0xf);
+
+        return;
+    }
+
+    std::uint64_t mask = (static_cast<std::uint64_t>(1) << bits) - 1;
+
+    std::uint64_t acc = 0;
+    int acc_bits = 0;
+
+    for (size_t i = 0; i < num_values; i++) {
+        acc |= (static_cast<std::uint64_t>(values[i]) & mask) << acc_bits;
+        acc_bits += bits;
+
+        while (acc_bits >= 8) {
+            *dst++ = static_cast<unsigned char>(acc);
+
+            acc >>= 8;
+            acc_bits -= 8;
+        }
+    }
+
+    if (acc_bits > 0)
+        *dst = static_cast<unsigned char>(acc);
+}
+
+// Inverse of pack_bits, src must hold packed_size(num_values, bits) bytes
+template<class T>
+void unpack_bits(
+    const unsigned char* src,
+    size_t num_values,
+    int bits,
+    T* dst
+) {
+    if (bits == 0) {
+        for (size_t i = 0; i < num_values; i++)
+            dst[i] = 0;
+
+        return;
+    }
+
+    const unsigned char* end = src + packed_size(num_values, bits);
+
+    std::uint64_t mask = (static_cast<std::uint64_t>(1) << bits) - 1;
+
+    std::uint64_t acc = 0;
+    int acc_bits = 0;
+
+    for (size_t i = 0; i < num_values; i++) {
+        if (acc_bits < bits) {
+            // Refill 32 bits at a time while possible, bits <= 32 so one refill always suffices
+            if (end - src >= 4) {
+                std::uint64_t word = static_cast<std::uint64_t>(src[0]) | (static_cast<std::uint64_t>(src[1]) << 8) |
+                    (static_cast<std::uint64_t>(src[2]) << 16) | (static_cast<std::uint64_t>(src[3]) << 24);
+
+                acc |= word << acc_bits;
+                acc_bits += 32;
+                src += 4;
+            }
+            else {
+                while (acc_bits < bits) {
+                    acc |= static_cast<std::uint64_t>(*src++) << acc_bits;
+                    acc_bits += 8;
+                }
+            }
+        }
+
+        dst[i] = static_cast<T>(acc & mask);
+
+        acc >>= bits;
+        acc_bits -= bits;
+    }
+}
+
+// Byte-oriented LZ77 in the style of LZ4: sequences of (token, literals, 16-bit offset, match length extension).
+// No external dependencies, meant for the zero-heavy payloads the adapters produce
+
+// Appends the compressed form of src to dst
+void lz_compress(
+    const unsigned char* src,
+    size_t size,
+    std::vector<unsigned char> &dst
+);
+
+// Decompresses exactly dst_size bytes, false if src is malformed or does not decode to exactly dst_size bytes
+bool lz_decompress(
+    const unsigned char* src,
+    size_t size,
+    unsigned char* dst,
+    size_t dst_size
+);
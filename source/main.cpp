@@ -11,6 +11,10 @@
 #include "imgui/imgui-SFML.h"
 #include "imgui_extra.h"
 #include "CSDR_Vis.h"
+#include "protocol.h"
+#include "codec.h"
+#include "shm_ring.h"
+#include "tail_file.h"
 
 #include <SFML/Window.hpp>
 #include <SFML/Graphics.hpp>
@@ -18,12 +22,19 @@
 
 #include <thread>
 #include <mutex>
+#include <atomic>
+#include <limits>
+#include <cmath>
+#include <cstdio>
 #include <array>
 #include <fstream>
 #include <iostream>
 
 const int max_str = 128;
 
+// Layers larger than this many pixels either way get a window this size that scrolls over them
+const float max_layer_window_size = 640.0f;
+
 typedef unsigned char field_type;
 
 enum Connection_Status {
@@ -34,15 +45,69 @@ Connection_Status connection_status;
 std::string address_str;
 std::string port_str;
 
+// Ask the adapter for LZ compressed payloads, worth it over slow links
+bool compression_enabled = false;
+
+// Ask the adapter to send states over UDP, so a late state is overtaken by newer ones instead of holding them up
+bool udp_enabled = false;
+
+sf::UdpSocket udp_socket;
+
+// Read states straight out of the adapter's shared memory ring when it runs on this host, TCP otherwise
+bool shm_enabled = false;
+
+Shm_Ring shm_ring;
+
+// Recording to tail instead of connecting (see Vis_Adapter::start_recording), and whether to play it back at the pace it was recorded
+std::string recording_str;
+
+bool replay_enabled = false;
+
+Tail_File tail_file;
+
+// Reduced receptive fields to ask the adapter for, cheaper to stream for large layers
+int field_bits = max_field_bits;
+int field_pool = 1;
+
+// Frames per second NeoVis draws at most
+const unsigned int frame_rate_limit = 60;
+
+// Most states per second to ask the adapter for, 0 for no limit. States beyond the frame rate would never be shown
+float max_rate = frame_rate_limit;
+
+// Set by the receive thread when it had to drop a state, the main loop asks for a keyframe to catch up
+std::atomic<bool> keyframe_needed(false);
+
 std::unique_ptr<std::thread> connect_thread;
 std::unique_ptr<std::thread> receive_thread;
 
 bool stop_receiving = false;
 
 void receive_thread_func(
-    sf::TcpSocket* socket
+    sf::TcpSocket* socket,
+    sf::UdpSocket* udp,
+    Shm_Ring* shm,
+    Tail_File* tail,
+    bool replay
 );
 
+// Sends one command with its header in front, body may be nullptr if size is 0
+bool send_command(sf::TcpSocket* socket, std::uint8_t type, const void* body, std::uint16_t size) {
+    std::vector<unsigned char> command(sizeof(Command_Header) + size);
+
+    Command_Header header;
+    header.size = size;
+    header.type = type;
+    header.reserved = 0;
+
+    std::memcpy(command.data(), &header, sizeof(Command_Header));
+
+    if (size > 0)
+        std::memcpy(&command[sizeof(Command_Header)], body, size);
+
+    return socket->send(command.data(), command.size()) == sf::Socket::Status::Done;
+}
+
 void enc_receiving() {
     if (receive_thread != nullptr) {
         stop_receiving = true;
@@ -95,15 +160,54 @@ void connect_thread_func(
     sf::Socket::Status status = socket->connect(addr.value(), port, sf::seconds(5.0f));
     
     if (status == sf::Socket::Status::Done) {
-        connection_status = connected;
+        // Announce what we can decode before anything else
+        Hello hello;
+        hello.magic = frame_magic;
+        hello.version = protocol_version;
+        hello.codecs = compression_enabled ? codec_lz : 0;
 
-        std::cout << "Connection established!" << std::endl;
+        std::memset(hello.reserved, 0, sizeof(hello.reserved));
+
+        if (!send_command(socket, command_hello, &hello, sizeof(Hello)))
+            status = sf::Socket::Status::Error;
+    }
 
+
+    if (status == sf::Socket::Status::Done) {
         if (receive_thread != nullptr)
             enc_receiving();
 
+        bool shm = false;
+
+        // Only an adapter on this host has the ring, one under the same name here is not the one connected to otherwise
+        if (shm_enabled && addr.value() == sf::IpAddress::LocalHost && shm_ring.open("/neovis_" + std::to_string(port))) {
+            std::uint8_t enable = 1;
+
+            shm = send_command(socket, command_enable_shm, &enable, sizeof(std::uint8_t));
+        }
+
+        bool udp = false;
+
+        if (udp_enabled && !shm) {
+            udp_socket.unbind();
+
+            // Stays on TCP only if no port is free
+            if (udp_socket.bind(sf::Socket::AnyPort) == sf::Socket::Status::Done) {
+                udp_socket.setBlocking(false);
+
+                std::uint16_t udp_port = udp_socket.getLocalPort();
+
+                udp = send_command(socket, command_enable_udp, &udp_port, sizeof(std::uint16_t));
+            }
+        }
+
+        // Only published once the above went out, the main thread sends its commands on the same socket as soon as it sees it
+        connection_status = connected;
+
+        std::cout << "Connection established!" << std::endl;
+
         // Start receiving
-        receive_thread.reset(new std::thread(receive_thread_func, socket));
+        receive_thread.reset(new std::thread(receive_thread_func, socket, udp ? &udp_socket : nullptr, shm ? &shm_ring : nullptr, nullptr, false));
 
         return;
     }
@@ -133,37 +237,133 @@ void connect_thread_func(
 
 struct Caret {
     std::uint16_t layer;
+    std::uint8_t field_bits;
+    std::uint8_t field_pool;
     sf::Vector3i pos;
 
     Caret()
     : layer(0),
+    field_bits(max_field_bits),
+    field_pool(1),
     pos(-1, -1, -1)
     {}
 };
 
+static_assert(sizeof(Caret) == 16, "Caret must stay a 16-byte record");
+
+struct Visible_Layer_Desc {
+    std::string name;
+    std::int32_t size_x;
+    std::int32_t size_y;
+    std::int32_t size_z;
+    std::int32_t radius; // 0 if the adapter does not know it
+};
+
+struct Layer_Desc {
+    std::string name;
+    std::uint32_t width, height, column_size;
+    std::vector<Visible_Layer_Desc> visible_layers;
+};
+
+// Shape of the hierarchy, sent only on connect and when it changes
+struct Topology {
+    std::uint32_t id;
+    std::uint32_t num_encs; // Number of layers that are pre-encoders
+    std::vector<Layer_Desc> layers;
+
+    Topology()
+    :
+    id(0),
+    num_encs(0)
+    {}
+};
+
 struct CSDR {
-    std::uint16_t width, height, column_size;
-    std::vector<std::int16_t> indices;
+    // Shared by every copy of the network, so publishing and showing a state copies no layers. Replaced, never modified, once decoded
+    std::shared_ptr<const std::vector<std::int32_t>> indices;
 };
 
 struct Field {
-    std::array<char, 64> name;
+    std::uint64_t version; // Changes whenever the weights do, 0 before any arrived
+
+    // Version a delta was applied to (0 if sent in full), and the x/y range of texels it touched
+    std::uint64_t base_version;
+    sf::Vector2i dirty_lower;
+    sf::Vector2i dirty_upper;
+
     std::int32_t field_size_x;
     std::int32_t field_size_y;
     std::int32_t field_size_z;
     std::vector<field_type> field;
+
+    Field()
+    :
+    version(0),
+    base_version(0),
+    field_size_x(0),
+    field_size_y(0),
+    field_size_z(0)
+    {}
+};
+
+// Fields of every hidden cell of a layer, streamed by the adapter on request (see command_request_weights)
+struct Layer_Weights {
+    std::uint32_t topology_id;
+    std::uint32_t layer;
+    std::uint32_t num_cells;
+
+    // Bytes of each cell's fields, and where each visible layer's field starts among them
+    size_t cell_size;
+    std::vector<size_t> field_offsets;
+
+    // Sized up front and filled in cell order, so cells already received can be read while later ones arrive
+    std::vector<field_type> data;
 };
 
 struct Network {
-    std::uint16_t num_layers;
-    std::uint16_t num_encs; // Number of layers that are encodeers
+    // Shared between copies, replaced (not modified) when a new topology arrives
+    std::shared_ptr<const Topology> topology;
+
     std::vector<CSDR> csdrs;
 
+    // Layer the fields belong to, one field per visible layer
+    std::uint32_t fields_layer;
     std::vector<Field> fields;
 
+    // Id of the caret the fields answer
+    std::uint32_t caret_id;
+
+    // Fields of the pinned cells, per pin of the pins with pins_id
+    std::uint32_t pins_id;
+    std::vector<std::vector<Field>> pinned_fields;
+
+    // Weights being downloaded or downloaded last, shared between copies, and how many of their cells arrived
+    std::shared_ptr<const Layer_Weights> weights;
+    std::uint32_t num_weight_cells;
+
+    // States received so far, and messages the sequence numbers say never arrived
+    std::uint64_t num_states;
+    std::uint64_t num_lost;
+
+    // Adapter's timestamp on the latest state, and when it arrived on viewer_clock
+    std::uint64_t timestamp;
+    sf::Time receive_time;
+
+    // Totals over every state and fields message parsed so far
+    std::uint64_t num_parsed_bytes;
+    float parse_time;
+
     Network()
     :
-    num_layers(0)
+    fields_layer(0),
+    caret_id(0),
+    pins_id(0),
+    num_weight_cells(0),
+    num_states(0),
+    num_lost(0),
+    timestamp(0),
+    num_parsed_bytes(0),
+    parse_time(0.0f)
     {}
 };
 
@@ -171,6 +371,18 @@ Network buffered_network;
 Network network;
 Caret caret;
 
+std::mutex network_mutex;
+
+// Monotonic, shared by the receive thread and the main loop
+sf::Clock viewer_clock;
+
+// Polls of an unchanged shared memory ring before the receive thread starts sleeping between them, and the longest sleep
+const int ring_spin_polls = 1000;
+const sf::Time max_ring_backoff = sf::milliseconds(1);
+
+// While states come through the ring, TCP only carries fields and such, so it is looked at this often
+const sf::Time tcp_check_interval = sf::milliseconds(10);
+
 bool recv(sf::TcpSocket* socket, void* data, int size) {
     int num_received = 0;
 
@@ -190,297 +402,1859 @@ bool recv(sf::TcpSocket* socket, void* data, int size) {
     return true;
 }
 
-void receive_thread_func(sf::TcpSocket* socket) {
-    while (!stop_receiving) {
-        if (recv(socket, &buffered_network.num_layers, sizeof(std::uint16_t))) {
-            recv(socket, &buffered_network.num_encs, sizeof(std::uint16_t));
+// Reads the next frame header, sliding byte by byte over the stream until a plausible header is found
+bool recv_frame_header(sf::TcpSocket* socket, Frame_Header &header) {
+    unsigned char* bytes = reinterpret_cast<unsigned char*>(&header);
 
-            buffered_network.csdrs.resize(buffered_network.num_layers);
+    if (!recv(socket, bytes, sizeof(Frame_Header)))
+        return false;
 
-            for (int l = 0; l < buffered_network.num_layers; l++) {
-                recv(socket, &buffered_network.csdrs[l].width, sizeof(std::uint16_t));
-                recv(socket, &buffered_network.csdrs[l].height, sizeof(std::uint16_t));
-                recv(socket, &buffered_network.csdrs[l].column_size, sizeof(std::uint16_t));
+    bool resynchronizing = false;
 
-                buffered_network.csdrs[l].indices.resize(buffered_network.csdrs[l].width * buffered_network.csdrs[l].height);
-                
-                recv(socket, buffered_network.csdrs[l].indices.data(), buffered_network.csdrs[l].indices.size() * sizeof(std::int16_t));
-            }
+    while (header.magic != frame_magic || header.size > max_frame_size) {
+        if (!resynchronizing) {
+            std::cout << "Stream corrupted, resynchronizing..." << std::endl;
 
-            // Number of fields
-            std::uint16_t num_fields;
+            resynchronizing = true;
+        }
 
-            recv(socket, &num_fields, sizeof(std::uint16_t));
-            
-            buffered_network.fields.resize(num_fields);
+        std::memmove(bytes, bytes + 1, sizeof(Frame_Header) - 1);
 
-            for (int f = 0; f < num_fields; f++) {
-                recv(socket, &buffered_network.fields[f].name, sizeof(buffered_network.fields[f].name));
-                recv(socket, &buffered_network.fields[f].field_size_x, sizeof(std::int32_t));
-                recv(socket, &buffered_network.fields[f].field_size_y, sizeof(std::int32_t));
-                recv(socket, &buffered_network.fields[f].field_size_z, sizeof(std::int32_t));
+        if (!recv(socket, bytes + sizeof(Frame_Header) - 1, 1))
+            return false;
+    }
 
-                buffered_network.fields[f].field.resize(buffered_network.fields[f].field_size_x * buffered_network.fields[f].field_size_y * buffered_network.fields[f].field_size_z);
-                recv(socket, buffered_network.fields[f].field.data(), buffered_network.fields[f].field.size() * sizeof(field_type));
-            }
-        }
+    if (header.version != protocol_version) {
+        std::cout << "Protocol version mismatch (got " << header.version << ", expected " << protocol_version << ")!" << std::endl;
+
+        socket->disconnect();
+
+        connection_status = disconnected;
+
+        return false;
     }
+
+    return true;
 }
 
-int main() {
-    sf::RenderWindow window(sf::VideoMode(sf::Vector2u(1280, 720)), "NeoVis", sf::Style::Default);
+// Scratch space for unpacking delta layers and compressed payloads
+std::vector<std::uint32_t> changed_columns;
+std::vector<std::int32_t> changed_indices;
+std::vector<unsigned char> decompressed;
 
-    window.setFramerateLimit(60);
-    window.setVerticalSyncEnabled(true);
+// Last version given to a field, received or resolved from downloaded weights
+std::atomic<std::uint64_t> field_version(0);
 
-    bool initialized = ImGui::SFML::Init(window);
+// Returns the reader to parse the payload following an encoding byte from: the frame itself, or
+// unpacked (pointing at the decompressed payload) if the payload was compressed. nullptr if malformed
+Frame_Reader* open_payload(Frame_Reader &reader, std::uint8_t &encoding, Frame_Reader &unpacked) {
+    if ((encoding & encoding_compressed) == 0)
+        return &reader;
 
-    window.resetGLStates();
+    encoding &= ~encoding_compressed;
 
-    //sf::Texture logoTex;
-    //logoTex.loadFromFile("resources/logo.png");
-    //logoTex.setSmooth(true);
+    std::uint32_t raw_size = reader.read<std::uint32_t>();
+    std::uint32_t compressed_size = reader.read<std::uint32_t>();
 
-    // ---------------------------- State ---------------------------
+    const unsigned char* compressed = reader.skip(compressed_size);
 
-    bool connection_wizard_open = false;
+    if (compressed == nullptr || raw_size > max_frame_size)
+        return nullptr;
 
-    // Read address and port
-    std::ifstream from_config("config.txt");
+    if (decompressed.size() < raw_size)
+        decompressed.resize(raw_size);
 
-    if (!from_config.is_open()) {
-        std::cout << "Could not open config file!" << std::endl;
+    if (!lz_decompress(compressed, compressed_size, decompressed.data(), raw_size))
+        return nullptr;
 
-        return 0;
+    unpacked = Frame_Reader(decompressed.data(), raw_size);
+
+    return &unpacked;
+}
+
+// Index buffers ever decoded into, those no copy of the network refers to any more get decoded into again
+std::vector<std::shared_ptr<std::vector<std::int32_t>>> indices_pool;
+
+std::shared_ptr<std::vector<std::int32_t>> acquire_indices() {
+    for (int i = 0; i < indices_pool.size(); i++) {
+        // Only the pool still refers to it
+        if (indices_pool[i].use_count() == 1)
+            return indices_pool[i];
     }
 
-    std::getline(from_config, address_str);
-    std::getline(from_config, port_str);
+    indices_pool.push_back(std::make_shared<std::vector<std::int32_t>>());
 
-    address_str.resize(max_str);
-    port_str.resize(max_str);
+    return indices_pool.back();
+}
 
-    std::vector<CSDR_Vis> layer_CSDR_vis;
-    std::vector<sf::Texture> field_textures;
-    std::vector<int> field_zs;
+bool parse_csdr(Frame_Reader &reader, const Layer_Desc &desc, CSDR &csdr) {
+    std::uint8_t encoding = reader.read<std::uint8_t>();
 
-    sf::TcpSocket socket;
+    // Keep what we have
+    if (encoding == csdr_encoding_skipped)
+        return reader.is_valid();
 
-    // ---------------------------- Loop ----------------------------
+    Frame_Reader unpacked(nullptr, 0);
 
-    sf::Clock delta_clock;
+    Frame_Reader* payload = open_payload(reader, encoding, unpacked);
 
-    while (window.isOpen()) {
-        int mouse_wheel_delta = 0;
+    if (payload == nullptr || !reader.is_valid())
+        return false;
 
-        while (const std::optional event = window.pollEvent()) {
-            ImGui::SFML::ProcessEvent(window, *event);
+    size_t num_columns = static_cast<size_t>(desc.width) * desc.height;
 
-            if (event->is<sf::Event::Closed>()) {
-                window.close();
+    int index_bits = bits_for(desc.column_size);
+    int column_bits = bits_for(num_columns);
 
-                break;
-            }
+    if (encoding == csdr_encoding_raw || encoding == csdr_encoding_raw32 || encoding == csdr_encoding_packed) {
+        size_t size = encoding == csdr_encoding_raw ? num_columns * sizeof(std::uint16_t) :
+            encoding == csdr_encoding_raw32 ? num_columns * sizeof(std::int32_t) : packed_size(num_columns, index_bits);
 
-            if (event->is<sf::Event::MouseWheelScrolled>())
-                mouse_wheel_delta = event->getIf<sf::Event::MouseWheelScrolled>()->delta;
-        }
+        const unsigned char* indices = payload->skip(size);
 
-        ImGui::SFML::Update(window, delta_clock.restart());
+        if (indices == nullptr)
+            return false;
 
-        if (ImGui::BeginMainMenuBar()) {
-            if (ImGui::BeginMenu("Connection")) {
-                if (ImGui::MenuItem("Connect...")) {
-                    connection_wizard_open = true;
-                }
+        std::shared_ptr<std::vector<std::int32_t>> decoded = acquire_indices();
 
-                ImGui::EndMenu();
-            }
+        decoded->resize(num_columns);
 
-            ImGui::EndMainMenuBar();
+        if (encoding == csdr_encoding_raw) {
+            for (size_t i = 0; i < num_columns; i++) {
+                std::uint16_t index;
+
+                std::memcpy(&index, &indices[i * sizeof(std::uint16_t)], sizeof(std::uint16_t));
+
+                (*decoded)[i] = index;
+            }
         }
+        else if (encoding == csdr_encoding_raw32)
+            std::memcpy(decoded->data(), indices, num_columns * sizeof(std::int32_t));
+        else
+            unpack_bits(indices, num_columns, index_bits, decoded->data());
 
-        if (connection_wizard_open) {
-            bool open = true;
+        csdr.indices = decoded;
+    }
+    else if (encoding == csdr_encoding_delta) {
+        // Can only patch a layer we already hold in full, resynchronized by the next keyframe otherwise
+        if (csdr.indices == nullptr || csdr.indices->size() != num_columns)
+            return false;
 
-            if (ImGui::Begin("Connection Wizard", &open)) {
-                ImGui::InputText("Address", &address_str[0], address_str.size());
-                
-                ImGui::NewLine();
-                
-                ImGui::InputText("Port", &port_str[0], port_str.size());
+        std::uint32_t num_changed = payload->read_varint();
 
-                ImGui::NewLine();
+        if (num_changed > num_columns)
+            return false;
 
-                std::string status_str;
-                
-                switch (connection_status) {
-                case connected:
-                    status_str = "Connected!";
-                    break;
-                case connecting:
-                    status_str = "Connecting...";
-                    break;
-                case disconnected:
-                    status_str = "Disconnected.";
-                    break;
-                }
+        const unsigned char* columns = payload->skip(packed_size(num_changed, column_bits));
+        const unsigned char* indices = payload->skip(packed_size(num_changed, index_bits));
 
-                if (ImGui::Button("Connect!")) {
-                    if (connect_thread != nullptr)
-                        connect_thread->join();
+        if (columns == nullptr || indices == nullptr)
+            return false;
 
-                    connect_thread.reset(new std::thread(connect_thread_func, &socket));
-                    
-                    // Save configuration
-                    std::ofstream to_config("config.txt");
+        // Nothing to copy for a layer that did not change
+        if (num_changed == 0)
+            return payload->is_valid();
 
-                    to_config << address_str << std::endl;
-                    to_config << port_str << std::endl;
-                }
+        changed_columns.resize(num_changed);
+        changed_indices.resize(num_changed);
 
-                ImGui::LabelText("Status", status_str.c_str());
+        unpack_bits(columns, num_changed, column_bits, changed_columns.data());
+        unpack_bits(indices, num_changed, index_bits, changed_indices.data());
 
-                ImGui::End();
-            }
-            
-            if (!open)
-                connection_wizard_open = false;
-        }
+        // The held layer may be shown right now, so patch a copy of it
+        std::shared_ptr<std::vector<std::int32_t>> patched = acquire_indices();
 
-        if (connection_status == disconnected) {
-            layer_CSDR_vis.clear();
-            field_textures.clear();
+        *patched = *csdr.indices;
+
+        for (std::uint32_t i = 0; i < num_changed; i++) {
+            if (changed_columns[i] >= num_columns)
+                return false;
+
+            (*patched)[changed_columns[i]] = changed_indices[i];
         }
-        else if (connection_status == connected) {
-            network = buffered_network;
 
-            // Send Caret
-            sf::Socket::Status status = socket.send(&caret, sizeof(Caret));
+        csdr.indices = patched;
+    }
+    else if (encoding == csdr_encoding_roi) {
+        if (csdr.indices == nullptr || csdr.indices->size() != num_columns)
+            return false;
 
-            // Init
-            if (layer_CSDR_vis.empty()) {
-                layer_CSDR_vis.resize(network.num_layers);
+        std::uint32_t x = payload->read_varint();
+        std::uint32_t y = payload->read_varint();
+        std::uint32_t width = payload->read_varint();
+        std::uint32_t height = payload->read_varint();
 
-                for (int l = 0; l < network.num_layers; l++)
-                    layer_CSDR_vis[l].init(network.csdrs[l].width, network.csdrs[l].height, network.csdrs[l].column_size);
-            }
+        if (x > desc.width || y > desc.height || width > desc.width - x || height > desc.height - y)
+            return false;
 
-            // Visualize content
-            for (int l = 0; l < network.num_layers; l++) {
-                CSDR &csdr = network.csdrs[l];
+        size_t num_changed = static_cast<size_t>(width) * height;
 
-                for (int i = 0; i < csdr.indices.size(); i++)
-                    layer_CSDR_vis[l][i] = csdr.indices[i];
+        const unsigned char* indices = payload->skip(packed_size(num_changed, index_bits));
 
-                layer_CSDR_vis[l].draw();
+        if (indices == nullptr)
+            return false;
 
-                if (l < network.num_encs)
-                    ImGui::Begin(("Pre-encoder " + std::to_string(l)).c_str(), nullptr, ImGuiWindowFlags_AlwaysAutoResize);
-                else
-                    ImGui::Begin(("Layer " + std::to_string(l - network.num_encs)).c_str(), nullptr, ImGuiWindowFlags_AlwaysAutoResize);
+        if (num_changed == 0)
+            return payload->is_valid();
 
-                bool hovering;
-                int hover_x = -1;
-                int hover_y = -1;
+        changed_indices.resize(num_changed);
 
-                ImGui::ImageHover(layer_CSDR_vis[l].get_texture(), hovering, hover_x, hover_y, ImVec2(layer_CSDR_vis[l].get_texture().getSize().x, layer_CSDR_vis[l].get_texture().getSize().y));
+        unpack_bits(indices, num_changed, index_bits, changed_indices.data());
 
-                if (hovering) {
-                    if (sf::Mouse::isButtonPressed(sf::Mouse::Button::Right)) {
-                        // Divide by size
-                        layer_CSDR_vis[l].highlight_x = static_cast<int>(hover_x / layer_CSDR_vis[l].node_space_size);
-                        layer_CSDR_vis[l].highlight_y = layer_CSDR_vis[l].get_size_in_nodes().y - static_cast<int>(hover_y / layer_CSDR_vis[l].node_space_size + 1.0f);
+        std::shared_ptr<std::vector<std::int32_t>> patched = acquire_indices();
 
-                        caret.pos = layer_CSDR_vis[l].get_highlighted_CSDR_pos();
-                        caret.layer = l;
-                    }
-                }
-                else {
-                    layer_CSDR_vis[l].highlight_x = -1;
-                    layer_CSDR_vis[l].highlight_y = -1;
-                }
-    
-                ImGui::End();
-            }
+        *patched = *csdr.indices;
 
-            // Show contents of caret position
-            field_textures.resize(network.fields.size());
-            field_zs.resize(network.fields.size(), 0);
+        // Columns are stored column by column, so each column of the rectangle is one run
+        for (std::uint32_t cx = 0; cx < width; cx++)
+            std::memcpy(&(*patched)[y + (x + cx) * desc.height], &changed_indices[cx * height], height * sizeof(std::int32_t));
 
-            for (int i = 0; i < network.fields.size(); i++) {
-                sf::Vector3i field_size = sf::Vector3i(network.fields[i].field_size_x, network.fields[i].field_size_y, network.fields[i].field_size_z);
+        csdr.indices = patched;
+    }
+    else
+        return false;
 
-                // Make sure is in range
-                field_zs[i] = std::min(field_size.z - 1, std::max(0, field_zs[i]));
+    return payload->is_valid();
+}
 
-                int empty = (field_size.x * field_size.y * field_size.z) == 0;
+// Applies a varint run count, then runs of (varint unchanged count, varint changed count, that many XOR bytes) to the field,
+// noting the texels touched
+bool apply_field_delta(Frame_Reader &payload, Field &field) {
+    std::uint32_t num_runs = payload.read_varint();
 
-                sf::Image w_img;
+    size_t pos = 0;
 
-                if (empty)
-                    w_img = sf::Image(sf::Vector2u(1, 1));
-                else {
-                    // If can use RGB for pre-encoder
-                    if (field_size.z == 3 && caret.layer < network.num_encs) {
-                        w_img = sf::Image(sf::Vector2u(field_size.x, field_size.y), sf::Color::Black);
+    int depth = field.field_size_z;
+    int column_stride = field.field_size_y * depth;
 
-                        for (int x = 0; x < w_img.getSize().x; x++)
-                            for (int y = 0; y < w_img.getSize().y; y++) {
-                                int indexR = 0 + 3 * (y + field_size.y * x);
-                                int indexG = 1 + 3 * (y + field_size.y * x);
-                                int indexB = 2 + 3 * (y + field_size.y * x);
+    field.dirty_lower = sf::Vector2i(field.field_size_x, field.field_size_y);
+    field.dirty_upper = sf::Vector2i(-1, -1);
 
-                                field_type r = network.fields[i].field[indexR];
-                                field_type g = network.fields[i].field[indexG];
-                                field_type b = network.fields[i].field[indexB];
+    for (std::uint32_t r = 0; r < num_runs; r++) {
+        std::uint32_t num_skipped = payload.read_varint();
+        std::uint32_t num_changed = payload.read_varint();
 
-                                w_img.setPixel(sf::Vector2u(x, y), sf::Color(r, g, b));
-                            }
-                    }
-                    else { // Seperate channels
-                        w_img = sf::Image(sf::Vector2u(field_size.x, field_size.y), sf::Color::Black);
+        const unsigned char* changes = payload.skip(num_changed);
 
-                        for (int x = 0; x < w_img.getSize().x; x++)
-                            for (int y = 0; y < w_img.getSize().y; y++) {
-                                int index = field_zs[i] + y * field_size.z + x * field_size.y * field_size.z;
+        if (changes == nullptr || num_skipped > field.field.size() - pos || num_changed > field.field.size() - pos - num_skipped)
+            return false;
 
-                                field_type value = network.fields[i].field[index];
+        pos += num_skipped;
 
-                                w_img.setPixel(sf::Vector2u(x, y), sf::Color(value, value, value));
-                            }
-                    }
-                }
+        for (std::uint32_t i = 0; i < num_changed; i++, pos++) {
+            field.field[pos] ^= changes[i];
 
-                field_textures[i] = sf::Texture(w_img);
+            int x = pos / column_stride;
+            int y = (pos / depth) % field.field_size_y;
 
-                field_textures[i].setSmooth(false);
+            field.dirty_lower = sf::Vector2i(std::min(field.dirty_lower.x, x), std::min(field.dirty_lower.y, y));
+            field.dirty_upper = sf::Vector2i(std::max(field.dirty_upper.x, x), std::max(field.dirty_upper.y, y));
+        }
+    }
 
-                std::string name = network.fields[i].name.data();
+    return payload.is_valid();
+}
 
-                ImGui::Begin(name.c_str(), nullptr, ImGuiWindowFlags_AlwaysAutoResize);
+bool parse_field(Frame_Reader &reader, Field &field) {
+    std::uint8_t status = reader.read<std::uint8_t>();
 
-                bool hovering;
-                int hover_x = -1;
-                int hover_y = -1;
+    // Keep what we hold, it must have been sent before
+    if (status == field_unchanged)
+        return reader.is_valid() && field.version != 0;
 
-                ImGui::ImageHover(field_textures[i], hovering, hover_x, hover_y, ImVec2(8.0f * w_img.getSize().x, 8.0f * w_img.getSize().y));
+    if (status != field_changed)
+        return false;
 
-                if (hovering) {
-                    // Select field Z
-                    field_zs[i] = std::min(network.fields[i].field_size_z - 1, std::max(0, field_zs[i] + mouse_wheel_delta));
+    std::int32_t field_size_x = reader.read_varint();
+    std::int32_t field_size_y = reader.read_varint();
+    std::int32_t field_size_z = reader.read_varint();
 
-                    ImGui::BeginTooltip();
+    std::uint8_t encoding = reader.read<std::uint8_t>();
 
-                    if ((network.fields[i].field_size_z == 3 || network.fields[i].field_size_z == 6) && caret.layer < network.num_encs)
-                        ImGui::SetTooltip("RGB");
-                    else
-                        ImGui::SetTooltip(("Z: " + std::to_string(field_zs[i])).c_str());
+    if (!reader.is_valid() || field_size_x < 0 || field_size_y < 0 || field_size_z < 0)
+        return false;
 
-                    ImGui::EndTooltip();
-                }
+    if (static_cast<std::uint64_t>(field_size_x) * field_size_y * field_size_z > max_frame_size)
+        return false;
 
-                ImGui::End();
+    Frame_Reader unpacked(nullptr, 0);
+
+    Frame_Reader* payload = open_payload(reader, encoding, unpacked);
+
+    if (payload == nullptr)
+        return false;
+
+    size_t field_count = static_cast<size_t>(field_size_x) * field_size_y * field_size_z;
+
+    if (encoding == field_encoding_xor_rle) {
+        // Patches the field we hold, which must have the same size
+        if (field.version == 0 || field_size_x != field.field_size_x || field_size_y != field.field_size_y || field_size_z != field.field_size_z)
+            return false;
+
+        if (!apply_field_delta(*payload, field)) {
+            // Partially patched, unusable until sent in full again
+            field.version = 0;
+
+            return false;
+        }
+
+        field.base_version = field.version;
+        field.version = ++field_version;
+
+        return true;
+    }
+
+    field.field_size_x = field_size_x;
+    field.field_size_y = field_size_y;
+    field.field_size_z = field_size_z;
+
+    if (encoding == field_encoding_raw) {
+        const unsigned char* weights = payload->skip(field_count * sizeof(field_type));
+
+        if (weights == nullptr)
+            return false;
+
+        field.field.resize(field_count);
+
+        std::memcpy(field.field.data(), weights, field_count * sizeof(field_type));
+    }
+    else if (encoding == field_encoding_quantized) {
+        int bits = payload->read<std::uint8_t>();
+
+        if (bits < 1 || bits >= max_field_bits)
+            return false;
+
+        const unsigned char* weights = payload->skip(packed_size(field_count, bits));
+
+        if (weights == nullptr)
+            return false;
+
+        field.field.resize(field_count);
+
+        unpack_bits(weights, field_count, bits, field.field.data());
+
+        // Stretch back over the full range
+        int max_value = (1 << bits) - 1;
+
+        for (size_t i = 0; i < field_count; i++)
+            field.field[i] = static_cast<field_type>(field.field[i] * 255 / max_value);
+    }
+    else
+        return false;
+
+    field.base_version = 0;
+    field.version = ++field_version;
+
+    return true;
+}
+
+bool parse_name(Frame_Reader &reader, std::string &name) {
+    std::uint32_t length = reader.read_varint();
+
+    const unsigned char* chars = reader.skip(length);
+
+    if (chars == nullptr)
+        return false;
+
+    name.assign(reinterpret_cast<const char*>(chars), length);
+
+    return true;
+}
+
+bool parse_topology(const unsigned char* data, size_t size, Topology &topology) {
+    Frame_Reader reader(data, size);
+
+    topology.id = reader.read<std::uint32_t>();
+
+    std::uint32_t num_layers = reader.read_varint();
+
+    topology.num_encs = reader.read_varint();
+
+    // Every layer takes at least a few bytes, so this also rejects absurd counts
+    if (!reader.is_valid() || num_layers > reader.get_remaining() || topology.num_encs > num_layers)
+        return false;
+
+    topology.layers.resize(num_layers);
+
+    for (int l = 0; l < num_layers; l++) {
+        Layer_Desc &desc = topology.layers[l];
+
+        if (!parse_name(reader, desc.name))
+            return false;
+
+        desc.width = reader.read_varint();
+        desc.height = reader.read_varint();
+        desc.column_size = reader.read_varint();
+
+        std::uint32_t num_visible_layers = reader.read_varint();
+
+        if (!reader.is_valid() || num_visible_layers > reader.get_remaining())
+            return false;
+
+        // Packed indices can take no bits at all, so guard against absurd sizes separately
+        if (static_cast<std::uint64_t>(desc.width) * desc.height > max_frame_size)
+            return false;
+
+        desc.visible_layers.resize(num_visible_layers);
+
+        for (int j = 0; j < num_visible_layers; j++) {
+            Visible_Layer_Desc &vld = desc.visible_layers[j];
+
+            if (!parse_name(reader, vld.name))
+                return false;
+
+            vld.size_x = reader.read_varint();
+            vld.size_y = reader.read_varint();
+            vld.size_z = reader.read_varint();
+            vld.radius = reader.read_varint();
+        }
+    }
+
+    return reader.is_valid();
+}
+
+// Layers of a state into csdrs, sized to the topology. Layers the state skips are left as they are
+bool parse_state(const unsigned char* data, size_t size, const Topology* topology, std::vector<CSDR> &csdrs) {
+    Frame_Reader reader(data, size);
+
+    std::uint32_t topology_id = reader.read<std::uint32_t>();
+
+    // Nothing to interpret the layers with until the matching topology arrived
+    if (topology == nullptr || topology_id != topology->id)
+        return false;
+
+    csdrs.resize(topology->layers.size());
+
+    for (int l = 0; l < topology->layers.size(); l++) {
+        if (!parse_csdr(reader, topology->layers[l], csdrs[l]))
+            return false;
+    }
+
+    return reader.is_valid();
+}
+
+bool parse_state(const unsigned char* data, size_t size, Network &net) {
+    return parse_state(data, size, net.topology.get(), net.csdrs);
+}
+
+bool parse_fields(const unsigned char* data, size_t size, Network &net) {
+    Frame_Reader reader(data, size);
+
+    std::uint32_t topology_id = reader.read<std::uint32_t>();
+
+    if (net.topology == nullptr || topology_id != net.topology->id)
+        return false;
+
+    const Topology &topology = *net.topology;
+
+    net.caret_id = reader.read<std::uint32_t>();
+
+    std::uint32_t fields_layer = reader.read_varint();
+
+    std::uint32_t num_fields = reader.read_varint();
+
+    // Unchanged fields refer to those of the same layer
+    if (fields_layer != net.fields_layer)
+        net.fields.clear();
+
+    net.fields_layer = fields_layer;
+
+    if (!reader.is_valid())
+        return false;
+
+    if (num_fields > 0 && (net.fields_layer >= topology.layers.size() || num_fields > topology.layers[net.fields_layer].visible_layers.size()))
+        return false;
+
+    net.fields.resize(num_fields);
+
+    for (int f = 0; f < num_fields; f++) {
+        if (!parse_field(reader, net.fields[f]))
+            return false;
+    }
+
+    return reader.is_valid();
+}
+
+bool parse_pinned_fields(const unsigned char* data, size_t size, Network &net) {
+    Frame_Reader reader(data, size);
+
+    std::uint32_t topology_id = reader.read<std::uint32_t>();
+
+    if (net.topology == nullptr || topology_id != net.topology->id)
+        return false;
+
+    const Topology &topology = *net.topology;
+
+    std::uint32_t pins_id = reader.read<std::uint32_t>();
+
+    std::uint32_t num_entries = reader.read_varint();
+
+    // Fields of other pins are of no use to diff against
+    if (pins_id != net.pins_id)
+        net.pinned_fields.clear();
+
+    net.pins_id = pins_id;
+
+    if (!reader.is_valid() || num_entries > max_pins)
+        return false;
+
+    // The entries do not say which layer their pin is on, no layer has more fields than its visible layers though
+    size_t max_fields = 0;
+
+    for (int l = 0; l < topology.layers.size(); l++)
+        max_fields = std::max(max_fields, topology.layers[l].visible_layers.size());
+
+    net.pinned_fields.resize(num_entries);
+
+    for (int e = 0; e < num_entries; e++) {
+        std::uint32_t pin = reader.read_varint();
+        std::uint32_t num_fields = reader.read_varint();
+
+        if (!reader.is_valid() || pin >= num_entries || num_fields > max_fields || num_fields > reader.get_remaining())
+            return false;
+
+        std::vector<Field> &fields = net.pinned_fields[pin];
+
+        fields.resize(num_fields);
+
+        for (int f = 0; f < num_fields; f++) {
+            if (!parse_field(reader, fields[f]))
+                return false;
+        }
+    }
+
+    return reader.is_valid();
+}
+
+// weights: the download the chunk continues, replaced when a new one starts
+bool parse_weights(const unsigned char* data, size_t size, Network &net, std::shared_ptr<Layer_Weights> &weights) {
+    Frame_Reader reader(data, size);
+
+    std::uint32_t topology_id = reader.read<std::uint32_t>();
+
+    if (net.topology == nullptr || topology_id != net.topology->id)
+        return false;
+
+    const Topology &topology = *net.topology;
+
+    std::uint32_t layer = reader.read_varint();
+    std::uint32_t first_cell = reader.read_varint();
+    std::uint32_t num_cells = reader.read_varint();
+    std::uint32_t total_cells = reader.read_varint();
+
+    std::uint8_t encoding = reader.read<std::uint8_t>();
+
+    if (!reader.is_valid() || layer >= topology.layers.size())
+        return false;
+
+    const Layer_Desc &desc = topology.layers[layer];
+
+    if (total_cells != static_cast<std::uint64_t>(desc.width) * desc.height * desc.column_size || first_cell > total_cells || num_cells > total_cells - first_cell)
+        return false;
+
+    if (first_cell == 0) {
+        weights = std::make_shared<Layer_Weights>();
+
+        weights->topology_id = topology_id;
+        weights->layer = layer;
+        weights->num_cells = total_cells;
+        weights->cell_size = 0;
+
+        for (int j = 0; j < desc.visible_layers.size(); j++) {
+            const Visible_Layer_Desc &vld = desc.visible_layers[j];
+
+            std::uint64_t diam = vld.radius * 2 + 1;
+
+            weights->field_offsets.push_back(weights->cell_size);
+            weights->cell_size += diam * diam * vld.size_z;
+        }
+
+        if (static_cast<std::uint64_t>(weights->cell_size) * total_cells > max_frame_size)
+            return false;
+
+        weights->data.resize(weights->cell_size * total_cells);
+
+        net.weights = weights;
+        net.num_weight_cells = 0;
+    }
+    else if (weights == nullptr || net.weights != weights || weights->topology_id != topology_id || weights->layer != layer || first_cell != net.num_weight_cells)
+        return false; // Not where the download we hold left off
+
+    Frame_Reader unpacked(nullptr, 0);
+
+    Frame_Reader* payload = open_payload(reader, encoding, unpacked);
+
+    if (payload == nullptr || encoding != field_encoding_raw)
+        return false;
+
+    const unsigned char* cells = payload->skip(static_cast<size_t>(num_cells) * weights->cell_size);
+
+    if (cells == nullptr)
+        return false;
+
+    if (num_cells > 0)
+        std::memcpy(&weights->data[first_cell * weights->cell_size], cells, num_cells * weights->cell_size);
+
+    net.num_weight_cells = first_cell + num_cells;
+
+    return payload->is_valid();
+}
+
+// Fields of the cell under the caret out of downloaded weights, false unless they hold that cell
+bool resolve_fields(const Network &net, const Caret &caret, std::vector<Field> &fields) {
+    if (net.weights == nullptr || net.topology == nullptr || net.weights->topology_id != net.topology->id || net.weights->layer != caret.layer)
+        return false;
+
+    const Layer_Desc &desc = net.topology->layers[caret.layer];
+
+    if (caret.pos.x < 0 || caret.pos.y < 0 || caret.pos.z < 0 || caret.pos.x >= desc.width || caret.pos.y >= desc.height || caret.pos.z >= desc.column_size)
+        return false;
+
+    size_t cell = caret.pos.z + desc.column_size * (caret.pos.y + static_cast<size_t>(desc.height) * caret.pos.x);
+
+    if (cell >= net.num_weight_cells)
+        return false;
+
+    const field_type* cell_fields = &net.weights->data[cell * net.weights->cell_size];
+
+    fields.resize(desc.visible_layers.size());
+
+    for (int j = 0; j < fields.size(); j++) {
+        const Visible_Layer_Desc &vld = desc.visible_layers[j];
+
+        Field &field = fields[j];
+
+        field.field_size_x = vld.radius * 2 + 1;
+        field.field_size_y = field.field_size_x;
+        field.field_size_z = vld.size_z;
+
+        const field_type* start = cell_fields + net.weights->field_offsets[j];
+
+        field.field.assign(start, start + static_cast<size_t>(field.field_size_x) * field.field_size_y * field.field_size_z);
+
+        field.base_version = 0;
+        field.version = ++field_version;
+    }
+
+    return true;
+}
+
+// The newest message coming in over UDP, put together from its datagrams
+struct Datagram_Assembly {
+    bool started;
+    std::uint32_t sequence;
+    int num_chunks;
+    int num_received;
+
+    std::vector<unsigned char> received; // Per chunk
+
+    std::vector<unsigned char> message;
+    size_t size; // Of the message, once its last chunk arrived
+
+    Datagram_Assembly()
+    :
+    started(false),
+    sequence(0),
+    num_chunks(0),
+    num_received(0),
+    size(0)
+    {}
+};
+
+// Takes in every datagram waiting, true once one completes a message (in assembly.message), which is then the newest one
+bool receive_datagrams(sf::UdpSocket &socket, Datagram_Assembly &assembly) {
+    unsigned char datagram[sizeof(Datagram_Header) + max_datagram_payload];
+
+    size_t size;
+    std::optional<sf::IpAddress> sender;
+    unsigned short port;
+
+    while (socket.receive(datagram, sizeof(datagram), size, sender, port) == sf::Socket::Status::Done) {
+        Datagram_Header header;
+
+        if (size < sizeof(Datagram_Header))
+            continue;
+
+        std::memcpy(&header, datagram, sizeof(Datagram_Header));
+
+        if (header.magic != frame_magic || header.chunk >= header.num_chunks)
+            continue;
+
+        // Part of a message older than the one being put together, too late to be of use
+        if (assembly.started && static_cast<std::int32_t>(header.sequence - assembly.sequence) < 0)
+            continue;
+
+        // A newer message drops whatever is missing of the current one
+        if (!assembly.started || header.sequence != assembly.sequence) {
+            assembly.started = true;
+            assembly.sequence = header.sequence;
+            assembly.num_chunks = header.num_chunks;
+            assembly.num_received = 0;
+            assembly.received.assign(header.num_chunks, 0);
+            assembly.message.resize(header.num_chunks * max_datagram_payload);
+        }
+
+        size_t payload_size = size - sizeof(Datagram_Header);
+
+        // Only the last chunk is shorter
+        if (header.num_chunks != assembly.num_chunks || assembly.received[header.chunk] || (header.chunk + 1 < header.num_chunks && payload_size != max_datagram_payload))
+            continue;
+
+        std::memcpy(&assembly.message[header.chunk * max_datagram_payload], &datagram[sizeof(Datagram_Header)], payload_size);
+
+        if (header.chunk + 1 == header.num_chunks)
+            assembly.size = header.chunk * max_datagram_payload + payload_size;
+
+        assembly.received[header.chunk] = true;
+        assembly.num_received++;
+
+        if (assembly.num_received == assembly.num_chunks)
+            return true;
+    }
+
+    return false;
+}
+
+// udp: where states arrive instead if UDP mode is on, nullptr otherwise
+// shm: the ring states are read from instead if shared memory is on, nullptr otherwise
+// tail: recording everything is read from instead of the socket, nullptr when connected. replay paces it as it was recorded
+void receive_thread_func(sf::TcpSocket* socket, sf::UdpSocket* udp, Shm_Ring* shm, Tail_File* tail, bool replay) {
+    // Reused across frames so steady state does not allocate
+    std::vector<unsigned char> frame_buffer;
+
+    Datagram_Assembly assembly;
+
+    sf::SocketSelector selector;
+
+    if (udp != nullptr || shm != nullptr)
+        selector.add(*socket);
+
+    if (udp != nullptr)
+        selector.add(*udp);
+
+    // Messages written into the ring so far, where the one being parsed lies, and its layers, only taken once it proved intact
+    std::uint64_t ring_read = 0;
+
+    int ring_slot = 0;
+    std::uint64_t ring_seq = 0;
+
+    std::vector<CSDR> ring_csdrs;
+
+    // Polls since the ring last had a new state, how long to sleep once done spinning, and when TCP was last looked at
+    int ring_idle_polls = 0;
+
+    sf::Time ring_backoff;
+
+    sf::Time last_tcp_check;
+    sf::Time last_ring_open = -tcp_check_interval;
+
+    bool tcp_busy = false;
+
+    std::string ring_name = shm != nullptr ? shm->get_name() : std::string();
+
+    // Where the next message of the recording starts, and the recording's timestamp matching when replay started
+    std::uint64_t tail_offset = 0;
+
+    bool replay_started = false;
+
+    std::uint64_t replay_timestamp = 0;
+    sf::Time replay_start;
+
+    Network received_network;
+
+    // Weights being downloaded, written here as chunks arrive
+    std::shared_ptr<Layer_Weights> received_weights;
+
+    // Forget what the previous connection sent
+    {
+        std::lock_guard<std::mutex> lock(network_mutex);
+
+        buffered_network = Network();
+    }
+
+    bool first_message = true;
+    bool first_datagram_message = true;
+    bool first_ring_message = true;
+
+    std::uint32_t next_sequence = 0;
+    std::uint32_t next_datagram_sequence = 0;
+    std::uint32_t next_ring_sequence = 0;
+
+    while (!stop_receiving) {
+        Frame_Header header;
+
+        const unsigned char* body;
+
+        bool from_udp = false;
+        bool from_ring = false;
+        bool from_file = false;
+
+        // Messages of a recording are parsed where they lie, as far as the writer got
+        if (tail != nullptr) {
+            if (tail_offset + sizeof(Frame_Header) > tail->get_cursor()) {
+                sf::sleep(sf::milliseconds(1));
+
+                continue;
+            }
+
+            std::memcpy(&header, tail->get_messages() + tail_offset, sizeof(Frame_Header));
+
+            if (header.magic != frame_magic || header.version != protocol_version || tail_offset + sizeof(Frame_Header) + header.size > tail->get_cursor()) {
+                std::cout << "Recording is corrupted, stopped reading it." << std::endl;
+
+                connection_status = disconnected;
+
+                break;
+            }
+
+            if (replay) {
+                if (!replay_started) {
+                    replay_timestamp = header.timestamp;
+                    replay_start = viewer_clock.getElapsedTime();
+
+                    replay_started = true;
+                }
+
+                // Not due yet
+                if (header.timestamp > replay_timestamp + (viewer_clock.getElapsedTime() - replay_start).asMicroseconds()) {
+                    sf::sleep(sf::milliseconds(1));
+
+                    continue;
+                }
+            }
+
+            // A recording is one stream, like TCP
+            if (!first_message)
+                received_network.num_lost += static_cast<std::uint32_t>(header.sequence - next_sequence);
+
+            first_message = false;
+
+            next_sequence = header.sequence + 1;
+
+            body = tail->get_messages() + tail_offset + sizeof(Frame_Header);
+
+            tail_offset += sizeof(Frame_Header) + header.size;
+
+            from_file = true;
+        }
+
+        // TCP (topology, fields and such) goes first whenever it is due: every so often, and right away again while messages keep
+        // coming. A ring that always has a newer state then never holds back the answer to a click
+        bool tcp_ready = false;
+
+        if (shm != nullptr) {
+            sf::Time now = viewer_clock.getElapsedTime();
+
+            if (tcp_busy || now - last_tcp_check >= tcp_check_interval) {
+                last_tcp_check = now;
+
+                tcp_busy = selector.wait(sf::microseconds(1)) && selector.isReady(*socket);
+
+                tcp_ready = tcp_busy;
+            }
+        }
+
+        // Checking the ring for a newer state is a couple of loads, no system call unless the adapter replaced the ring
+        if (shm != nullptr && !tcp_ready) {
+            // Opening is a system call, so a ring that is not there (yet) is only looked for every so often
+            if ((!shm->is_open() || shm->is_closed()) && viewer_clock.getElapsedTime() - last_ring_open >= tcp_check_interval) {
+                last_ring_open = viewer_clock.getElapsedTime();
+
+                if (shm->open(ring_name))
+                    ring_read = 0;
+            }
+
+            size_t size;
+
+            const unsigned char* message = shm->is_open() ? shm->read_latest(ring_read, size, ring_slot, ring_seq) : nullptr;
+
+            if (message != nullptr && size >= sizeof(Frame_Header)) {
+                std::memcpy(&header, message, sizeof(Frame_Header));
+
+                if (header.magic == frame_magic && header.version == protocol_version && header.type == message_state && header.size == size - sizeof(Frame_Header)) {
+                    // Counted apart from the TCP stream, states overwritten before they were read are lost too
+                    if (!first_ring_message)
+                        received_network.num_lost += static_cast<std::uint32_t>(header.sequence - next_ring_sequence);
+
+                    first_ring_message = false;
+
+                    next_ring_sequence = header.sequence + 1;
+
+                    // Parsed where it lies, not copied out
+                    body = message + sizeof(Frame_Header);
+
+                    from_ring = true;
+                }
+            }
+        }
+
+        if (from_ring)
+            ring_idle_polls = 0;
+        else if (shm != nullptr && !tcp_ready) {
+            // Nothing new in the ring. It is spun on for a while, as polling it makes no system call, then polled less and less often
+            ring_idle_polls++;
+
+            if (ring_idle_polls == ring_spin_polls)
+                ring_backoff = sf::microseconds(50);
+            else if (ring_idle_polls > ring_spin_polls) {
+                sf::sleep(ring_backoff);
+
+                ring_backoff = std::min(max_ring_backoff, ring_backoff + ring_backoff);
+            }
+
+            continue;
+        }
+
+        // States may come in over UDP while everything else keeps coming over TCP
+        if (!from_ring && !from_file && udp != nullptr) {
+            if (!selector.wait(sf::milliseconds(100)))
+                continue;
+
+            if (selector.isReady(*udp) && receive_datagrams(*udp, assembly))
+                from_udp = true;
+            else if (!selector.isReady(*socket))
+                continue;
+        }
+
+        // Header and body of a state from the ring or a recording were taken above
+        if (from_udp) {
+            if (assembly.size < sizeof(Frame_Header))
+                continue;
+
+            std::memcpy(&header, assembly.message.data(), sizeof(Frame_Header));
+
+            if (header.magic != frame_magic || header.version != protocol_version || header.type != message_state || header.size != assembly.size - sizeof(Frame_Header))
+                continue;
+
+            // Counted apart from the TCP stream, messages that did not arrive whole are lost too
+            if (!first_datagram_message)
+                received_network.num_lost += static_cast<std::uint32_t>(header.sequence - next_datagram_sequence);
+
+            first_datagram_message = false;
+
+            next_datagram_sequence = header.sequence + 1;
+
+            body = assembly.message.data() + sizeof(Frame_Header);
+        }
+        else if (!from_ring && !from_file) {
+            if (!recv_frame_header(socket, header))
+                break;
+
+            // Wraps around like the sequence does
+            if (!first_message)
+                received_network.num_lost += static_cast<std::uint32_t>(header.sequence - next_sequence);
+
+            first_message = false;
+
+            next_sequence = header.sequence + 1;
+
+            if (frame_buffer.size() < header.size)
+                frame_buffer.resize(header.size);
+
+            // Whole body in one bulk read
+            if (!recv(socket, frame_buffer.data(), header.size))
+                break;
+
+            body = frame_buffer.data();
+        }
+
+        if (header.type == message_topology) {
+            std::shared_ptr<Topology> topology = std::make_shared<Topology>();
+
+            if (!parse_topology(body, header.size, *topology)) {
+                std::cout << "Dropped malformed topology " << header.sequence << "." << std::endl;
+
+                continue;
+            }
+
+            // Layers of the same size keep their indices so deltas against them stay valid
+            received_network.topology = topology;
+            received_network.csdrs.resize(topology->layers.size());
+            received_network.fields.clear();
+            received_network.pinned_fields.clear();
+
+            for (int l = 0; l < topology->layers.size(); l++) {
+                const Layer_Desc &desc = topology->layers[l];
+
+                if (received_network.csdrs[l].indices != nullptr && received_network.csdrs[l].indices->size() != static_cast<size_t>(desc.width) * desc.height)
+                    received_network.csdrs[l].indices = nullptr;
+            }
+
+            // Published along with the first state that follows it
+            continue;
+        }
+
+        bool parsed;
+
+        sf::Time parse_start = viewer_clock.getElapsedTime();
+
+        // Layers of a ring state are decoded aside, so one the adapter overwrites meanwhile leaves the held layers as they were
+        if (from_ring) {
+            for (int l = 0; l < ring_csdrs.size(); l++)
+                ring_csdrs[l].indices = nullptr;
+
+            parsed = parse_state(body, header.size, received_network.topology.get(), ring_csdrs);
+        }
+        else if (header.type == message_state)
+            parsed = parse_state(body, header.size, received_network);
+        else if (header.type == message_fields)
+            parsed = parse_fields(body, header.size, received_network);
+        else if (header.type == message_pinned_fields)
+            parsed = parse_pinned_fields(body, header.size, received_network);
+        else if (header.type == message_weights)
+            parsed = parse_weights(body, header.size, received_network, received_weights);
+        else
+            continue;
+
+        received_network.num_parsed_bytes += header.size;
+        received_network.parse_time += (viewer_clock.getElapsedTime() - parse_start).asSeconds();
+
+        // The adapter may have overwritten the slot while it was parsed, leaving layers of two states. The next state follows soon
+        if (from_ring) {
+            if (!parsed || !shm->is_intact(ring_slot, ring_seq))
+                continue;
+
+            received_network.csdrs.resize(ring_csdrs.size());
+
+            // Layers the state skipped stay as they were
+            for (int l = 0; l < ring_csdrs.size(); l++) {
+                if (ring_csdrs[l].indices != nullptr)
+                    received_network.csdrs[l].indices = std::move(ring_csdrs[l].indices);
+            }
+        }
+
+        if (!parsed) {
+            std::cout << "Dropped malformed frame " << header.sequence << "." << std::endl;
+
+            // Keyframes also resend fields in full
+            keyframe_needed = true;
+
+            continue;
+        }
+
+        if (header.type == message_state) {
+            received_network.num_states++;
+            received_network.timestamp = header.timestamp;
+            received_network.receive_time = viewer_clock.getElapsedTime();
+        }
+
+        // Catching up on a recording only shows where it got to
+        if (from_file && !replay && tail_offset < tail->get_cursor())
+            continue;
+
+        std::lock_guard<std::mutex> lock(network_mutex);
+
+        buffered_network = received_network;
+    }
+}
+
+// Fixed-length history of one statistic, plotted oldest first
+struct Graph {
+    std::vector<float> values;
+    int offset;
+
+    Graph()
+    :
+    values(120, 0.0f),
+    offset(0)
+    {}
+
+    void push(float value) {
+        values[offset] = value;
+
+        offset = (offset + 1) % values.size();
+    }
+
+    // format shows the latest value
+    void plot(const char* label, const char* format) const {
+        char overlay[64];
+
+        std::snprintf(overlay, sizeof(overlay), format, values[(offset + values.size() - 1) % values.size()]);
+
+        ImGui::PlotLines(label, values.data(), values.size(), offset, overlay, 0.0f, FLT_MAX, ImVec2(240.0f, 60.0f));
+    }
+};
+
+// Color of texel (x, y) of a field: its RGB weights, or the weight at Z as gray
+sf::Color get_field_color(const Field &field, int x, int y, int z, bool rgb) {
+    if (rgb) {
+        int index = 3 * (y + field.field_size_y * x);
+
+        return sf::Color(field.field[index], field.field[index + 1], field.field[index + 2]);
+    }
+
+    field_type value = field.field[z + y * field.field_size_z + x * field.field_size_y * field.field_size_z];
+
+    return sf::Color(value, value, value);
+}
+
+// Image of a field: its RGB weights, or the weights at Z as gray
+sf::Image get_field_image(const Field &field, int z, bool rgb) {
+    if (field.field_size_x * field.field_size_y * field.field_size_z == 0)
+        return sf::Image(sf::Vector2u(1, 1));
+
+    sf::Image img(sf::Vector2u(field.field_size_x, field.field_size_y), sf::Color::Black);
+
+    for (int x = 0; x < img.getSize().x; x++)
+        for (int y = 0; y < img.getSize().y; y++)
+            img.setPixel(sf::Vector2u(x, y), get_field_color(field, x, y, z, rgb));
+
+    return img;
+}
+
+int main() {
+    sf::RenderWindow window(sf::VideoMode(sf::Vector2u(1280, 720)), "NeoVis", sf::Style::Default);
+
+    window.setFramerateLimit(frame_rate_limit);
+    window.setVerticalSyncEnabled(true);
+
+    bool initialized = ImGui::SFML::Init(window);
+
+    window.resetGLStates();
+
+    //sf::Texture logoTex;
+    //logoTex.loadFromFile("resources/logo.png");
+    //logoTex.setSmooth(true);
+
+    // ---------------------------- State ---------------------------
+
+    bool connection_wizard_open = false;
+
+    // Read address and port
+    std::ifstream from_config("config.txt");
+
+    if (!from_config.is_open()) {
+        std::cout << "Could not open config file!" << std::endl;
+
+        return 0;
+    }
+
+    std::getline(from_config, address_str);
+    std::getline(from_config, port_str);
+
+    address_str.resize(max_str);
+    port_str.resize(max_str);
+    recording_str.resize(max_str);
+
+    std::vector<CSDR_Vis> layer_CSDR_vis;
+
+    // Topology layer_CSDR_vis was initialized for
+    std::shared_ptr<const Topology> rendered_topology;
+
+    // Layers as last copied into layer_CSDR_vis
+    std::vector<CSDR> shown_csdrs;
+
+    // Per layer whether its window is open (can be reopened from the Layers menu), and whether it was drawn last frame
+    std::vector<unsigned char> layer_open;
+    std::vector<unsigned char> layer_visible;
+    std::vector<unsigned char> sent_layer_visible;
+
+    Frame_Writer subscribe_body;
+
+    // Per layer the columns its window shows (x, y, width, height), all 0 while it shows them all
+    std::vector<std::array<std::uint32_t, 4>> layer_rois;
+    std::vector<std::array<std::uint32_t, 4>> sent_layer_rois;
+
+    Frame_Writer roi_body;
+
+    // Layer whose weights to download (-1 for none), and the one asked for last
+    int weights_layer = -1;
+    int sent_weights_layer = -1;
+
+    Frame_Writer weights_body;
+
+    // Cells whose fields are shown side by side (only their layer and position are used), and whether the adapter has yet to hear of them
+    std::vector<Caret> pins;
+    std::uint32_t pins_id = 0;
+    bool pins_dirty = false;
+
+    Frame_Writer pins_body;
+
+    // Per pin and field, drawn from which field version
+    std::vector<std::vector<sf::Texture>> pin_textures;
+    std::vector<std::vector<std::uint64_t>> pin_texture_versions;
+
+    // Fields of the current caret resolved from downloaded weights, shown until the adapter answers it
+    std::vector<Field> local_fields;
+    bool local_fields_valid = false;
+
+    // What the adapter was last told, set again after reconnecting
+    Caret sent_caret;
+    std::uint32_t caret_id = 0;
+    float sent_max_rate = 0.0f;
+    bool commands_sent = false;
+
+    // Seconds from sending the last caret to showing its fields
+    sf::Clock caret_clock;
+    bool caret_pending = false;
+    float caret_latency = 0.0f;
+
+    bool statistics_open = false;
+
+    // Sampled per shown state
+    Graph display_latency_graph; // Milliseconds from a state arriving to showing it
+    Graph transit_delay_graph; // Milliseconds a state took to arrive beyond the quickest one, going by the adapter's timestamps
+
+    // Sampled every second
+    Graph fps_graph; // States received
+    Graph dropped_graph; // States overwritten before being shown, plus messages lost on the way
+    Graph parse_graph; // Megabytes of messages parsed per second spent parsing
+
+    std::uint64_t second_num_parsed_bytes = 0;
+    float second_parse_time = 0.0f;
+
+    std::uint64_t shown_num_states = 0;
+    std::uint64_t shown_num_lost = 0;
+    std::int64_t min_transit = std::numeric_limits<std::int64_t>::max();
+
+    int second_num_states = 0;
+    int second_num_dropped = 0;
+    sf::Clock second_clock;
+    std::vector<sf::Texture> field_textures;
+
+    // Field version and Z each texture was drawn from
+    std::vector<std::uint64_t> field_texture_versions;
+    std::vector<int> field_texture_zs;
+    std::vector<int> field_zs;
+
+    sf::TcpSocket socket;
+
+    // ---------------------------- Loop ----------------------------
+
+    sf::Clock delta_clock;
+
+    while (window.isOpen()) {
+        int mouse_wheel_delta = 0;
+
+        while (const std::optional event = window.pollEvent()) {
+            ImGui::SFML::ProcessEvent(window, *event);
+
+            if (event->is<sf::Event::Closed>()) {
+                window.close();
+
+                break;
+            }
+
+            if (event->is<sf::Event::MouseWheelScrolled>())
+                mouse_wheel_delta = event->getIf<sf::Event::MouseWheelScrolled>()->delta;
+        }
+
+        ImGui::SFML::Update(window, delta_clock.restart());
+
+        if (ImGui::BeginMainMenuBar()) {
+            if (ImGui::BeginMenu("Connection")) {
+                if (ImGui::MenuItem("Connect...")) {
+                    connection_wizard_open = true;
+                }
+
+                ImGui::MenuItem("Statistics", nullptr, &statistics_open);
+
+                ImGui::SliderFloat("Max rate", &max_rate, 0.0f, 120.0f, max_rate == 0.0f ? "No limit" : "%.0f/s");
+
+                ImGui::EndMenu();
+            }
+
+            if (ImGui::BeginMenu("Layers")) {
+                if (rendered_topology != nullptr) {
+                    for (int l = 0; l < layer_open.size(); l++) {
+                        bool open = layer_open[l];
+
+                        ImGui::MenuItem(rendered_topology->layers[l].name.c_str(), nullptr, &open);
+
+                        layer_open[l] = open;
+                    }
+                }
+
+                ImGui::EndMenu();
+            }
+
+            if (ImGui::BeginMenu("Fields")) {
+                ImGui::SliderInt("Weight bits", &field_bits, 1, max_field_bits);
+                ImGui::SliderInt("Pooling", &field_pool, 1, 8);
+
+                if (ImGui::MenuItem("Clear pins", nullptr, false, !pins.empty())) {
+                    pins.clear();
+
+                    pins_dirty = true;
+                }
+
+                // Carets in the downloaded layer are then answered without asking the adapter
+                if (ImGui::BeginMenu("Download weights", rendered_topology != nullptr)) {
+                    for (int l = 0; l < rendered_topology->layers.size(); l++) {
+                        if (ImGui::MenuItem(rendered_topology->layers[l].name.c_str(), nullptr, weights_layer == l)) {
+                            weights_layer = l;
+
+                            // Picking it again downloads it again
+                            sent_weights_layer = -1;
+                        }
+                    }
+
+                    ImGui::EndMenu();
+                }
+
+                ImGui::EndMenu();
+            }
+
+            if (connection_status == connected)
+                ImGui::Text("Caret latency: %.1f ms", caret_latency * 1000.0f);
+
+            if (connection_status == connected && network.weights != nullptr && network.num_weight_cells < network.weights->num_cells) {
+                float progress = static_cast<float>(network.num_weight_cells) / network.weights->num_cells;
+
+                char overlay[64];
+
+                std::snprintf(overlay, sizeof(overlay), "Weights %.0f%%", progress * 100.0f);
+
+                ImGui::ProgressBar(progress, ImVec2(160.0f, 0.0f), overlay);
+            }
+
+            ImGui::EndMainMenuBar();
+        }
+
+        if (connection_wizard_open) {
+            bool open = true;
+
+            if (ImGui::Begin("Connection Wizard", &open)) {
+                ImGui::InputText("Address", &address_str[0], address_str.size());
+                
+                ImGui::NewLine();
+                
+                ImGui::InputText("Port", &port_str[0], port_str.size());
+
+                ImGui::NewLine();
+
+                ImGui::Checkbox("Compression", &compression_enabled);
+
+                ImGui::Checkbox("UDP states", &udp_enabled);
+
+                ImGui::Checkbox("Shared memory states (localhost)", &shm_enabled);
+
+                ImGui::NewLine();
+
+                std::string status_str;
+                
+                switch (connection_status) {
+                case connected:
+                    status_str = "Connected!";
+                    break;
+                case connecting:
+                    status_str = "Connecting...";
+                    break;
+                case disconnected:
+                    status_str = "Disconnected.";
+                    break;
+                }
+
+                if (ImGui::Button("Connect!")) {
+                    if (connect_thread != nullptr)
+                        connect_thread->join();
+
+                    connect_thread.reset(new std::thread(connect_thread_func, &socket));
+                    
+                    // Save configuration
+                    std::ofstream to_config("config.txt");
+
+                    to_config << address_str << std::endl;
+                    to_config << port_str << std::endl;
+                }
+
+                ImGui::NewLine();
+
+                // A recording stands in for the adapter, with nothing to send commands to
+                ImGui::InputText("Recording", &recording_str[0], recording_str.size());
+
+                ImGui::Checkbox("Replay at recorded pace", &replay_enabled);
+
+                if (ImGui::Button("Tail!")) {
+                    if (connect_thread != nullptr)
+                        connect_thread->join();
+
+                    socket.disconnect();
+
+                    enc_receiving();
+
+                    std::string path(recording_str.c_str());
+
+                    if (tail_file.open(path)) {
+                        connection_status = connected;
+
+                        receive_thread.reset(new std::thread(receive_thread_func, nullptr, nullptr, nullptr, &tail_file, replay_enabled));
+                    }
+                    else {
+                        connection_status = disconnected;
+
+                        std::cout << "Could not open recording \"" << path << "\"!" << std::endl;
+                    }
+                }
+
+                ImGui::NewLine();
+
+                ImGui::LabelText("Status", status_str.c_str());
+
+                ImGui::End();
+            }
+            
+            if (!open)
+                connection_wizard_open = false;
+        }
+
+        if (connection_status == disconnected) {
+            layer_CSDR_vis.clear();
+            shown_csdrs.clear();
+            field_textures.clear();
+            field_texture_versions.clear();
+            field_texture_zs.clear();
+
+            rendered_topology = nullptr;
+
+            commands_sent = false;
+        }
+        else if (connection_status == connected) {
+            {
+                std::lock_guard<std::mutex> lock(network_mutex);
+
+                network = buffered_network;
+            }
+
+            // A new connection starts counting over
+            if (network.num_states < shown_num_states) {
+                shown_num_states = 0;
+                shown_num_lost = 0;
+                min_transit = std::numeric_limits<std::int64_t>::max();
+            }
+
+            if (network.num_states != shown_num_states) {
+                int num_new = network.num_states - shown_num_states;
+
+                // Only the latest of the new states gets shown
+                second_num_states += num_new;
+                second_num_dropped += num_new - 1 + (network.num_lost - shown_num_lost);
+
+                shown_num_states = network.num_states;
+                shown_num_lost = network.num_lost;
+
+                display_latency_graph.push((viewer_clock.getElapsedTime() - network.receive_time).asSeconds() * 1000.0f);
+
+                // Clocks are not synchronized, so this only tells how much longer than the quickest state it took
+                std::int64_t transit = network.receive_time.asMicroseconds() - static_cast<std::int64_t>(network.timestamp);
+
+                min_transit = std::min(min_transit, transit);
+
+                transit_delay_graph.push((transit - min_transit) / 1000.0f);
+            }
+
+            if (second_clock.getElapsedTime() >= sf::seconds(1.0f)) {
+                fps_graph.push(second_num_states / second_clock.restart().asSeconds());
+                dropped_graph.push(second_num_dropped);
+
+                float parse_time = network.parse_time - second_parse_time;
+
+                if (parse_time > 0.0f && network.num_parsed_bytes >= second_num_parsed_bytes)
+                    parse_graph.push((network.num_parsed_bytes - second_num_parsed_bytes) / parse_time / 1000000.0f);
+
+                second_num_parsed_bytes = network.num_parsed_bytes;
+                second_parse_time = network.parse_time;
+
+                second_num_states = 0;
+                second_num_dropped = 0;
+            }
+
+            if (statistics_open) {
+                if (ImGui::Begin("Statistics", &statistics_open, ImGuiWindowFlags_AlwaysAutoResize)) {
+                    display_latency_graph.plot("Display latency", "%.1f ms");
+                    transit_delay_graph.plot("Transit delay", "%.1f ms");
+                    fps_graph.plot("Network fps", "%.0f");
+                    dropped_graph.plot("Dropped/s", "%.0f");
+                    parse_graph.plot("Parse throughput", "%.0f MB/s");
+                }
+
+                ImGui::End();
+            }
+
+            caret.field_bits = field_bits;
+            caret.field_pool = field_pool;
+
+            // Time from the caret going out to its fields being shown
+            if (caret_pending && network.caret_id == caret_id) {
+                caret_latency = caret_clock.getElapsedTime().asSeconds();
+
+                caret_pending = false;
+            }
+
+            // Only tell the adapter what changed
+            if (!commands_sent || std::memcmp(&caret, &sent_caret, sizeof(Caret)) != 0) {
+                caret_id++;
+
+                unsigned char body[sizeof(Caret) + sizeof(std::uint32_t)];
+
+                std::memcpy(body, &caret, sizeof(Caret));
+                std::memcpy(&body[sizeof(Caret)], &caret_id, sizeof(std::uint32_t));
+
+                send_command(&socket, command_set_caret, body, sizeof(body));
+
+                sent_caret = caret;
+
+                caret_clock.restart();
+                caret_pending = true;
+
+                // Downloaded weights answer it right away, the adapter's answer (with the latest weights) replaces them once it arrives
+                local_fields_valid = resolve_fields(network, caret, local_fields);
+
+                if (local_fields_valid) {
+                    caret_latency = caret_clock.getElapsedTime().asSeconds();
+
+                    caret_pending = false;
+                }
+            }
+
+            if (local_fields_valid && network.caret_id != caret_id) {
+                network.fields_layer = caret.layer;
+                network.fields = local_fields;
+            }
+
+            if (!commands_sent || pins_dirty) {
+                pins_id++;
+
+                pins_body.clear();
+
+                pins_body.push<std::uint32_t>(pins_id);
+                pins_body.push_varint(pins.size());
+
+                for (int p = 0; p < pins.size(); p++) {
+                    pins_body.push_varint(pins[p].layer);
+                    pins_body.push_varint(pins[p].pos.x);
+                    pins_body.push_varint(pins[p].pos.y);
+                    pins_body.push_varint(pins[p].pos.z);
+                }
+
+                send_command(&socket, command_set_pins, pins_body.get_data(), pins_body.get_size());
+
+                pins_dirty = false;
+            }
+
+            if (weights_layer >= 0 && (!commands_sent || weights_layer != sent_weights_layer)) {
+                weights_body.clear();
+
+                weights_body.push_varint(weights_layer);
+
+                send_command(&socket, command_request_weights, weights_body.get_data(), weights_body.get_size());
+
+                sent_weights_layer = weights_layer;
+            }
+
+            if (!commands_sent || max_rate != sent_max_rate) {
+                send_command(&socket, command_set_max_rate, &max_rate, sizeof(float));
+
+                sent_max_rate = max_rate;
+            }
+
+            if (keyframe_needed.exchange(false))
+                send_command(&socket, command_request_keyframe, nullptr, 0);
+
+            // Only the layers being looked at
+            if (!commands_sent || layer_visible != sent_layer_visible) {
+                subscribe_body.clear();
+
+                subscribe_body.push_varint(layer_visible.size());
+
+                pack_bits(layer_visible.data(), layer_visible.size(), 1, subscribe_body.add(packed_size(layer_visible.size(), 1)));
+
+                send_command(&socket, command_subscribe, subscribe_body.get_data(), subscribe_body.get_size());
+
+                sent_layer_visible = layer_visible;
+            }
+
+            // Only the columns being looked at of layers too large to show whole
+            if (!commands_sent)
+                sent_layer_rois.clear();
+
+            sent_layer_rois.resize(layer_rois.size(), std::array<std::uint32_t, 4>{ 0, 0, 0, 0 });
+
+            for (int l = 0; l < layer_rois.size(); l++) {
+                if (layer_rois[l] == sent_layer_rois[l])
+                    continue;
+
+                roi_body.clear();
+
+                roi_body.push_varint(l);
+
+                for (int k = 0; k < 4; k++)
+                    roi_body.push_varint(layer_rois[l][k]);
+
+                send_command(&socket, command_set_roi, roi_body.get_data(), roi_body.get_size());
+
+                sent_layer_rois[l] = layer_rois[l];
+            }
+
+            commands_sent = true;
+
+            // (Re)init whenever a new topology arrived
+            if (network.topology != rendered_topology) {
+                rendered_topology = network.topology;
+
+                layer_CSDR_vis.clear();
+                shown_csdrs.clear();
+
+                // Windows of layers that are still there stay as they were
+                layer_open.resize(rendered_topology == nullptr ? 0 : rendered_topology->layers.size(), 1);
+                layer_visible.resize(layer_open.size(), 1);
+                layer_rois.resize(layer_open.size(), std::array<std::uint32_t, 4>{ 0, 0, 0, 0 });
+
+                if (rendered_topology != nullptr) {
+                    layer_CSDR_vis.resize(rendered_topology->layers.size());
+
+                    for (int l = 0; l < rendered_topology->layers.size(); l++) {
+                        const Layer_Desc &desc = rendered_topology->layers[l];
+
+                        layer_CSDR_vis[l].init(desc.width, desc.height, desc.column_size);
+                    }
+                }
+            }
+
+            // Visualize content
+            shown_csdrs.resize(layer_CSDR_vis.size());
+
+            for (int l = 0; l < layer_CSDR_vis.size(); l++) {
+                layer_visible[l] = false;
+
+                if (!layer_open[l])
+                    continue;
+
+                bool open = true;
+
+                const Layer_Desc &desc = rendered_topology->layers[l];
+
+                sf::Vector2u texture_size = layer_CSDR_vis[l].get_texture().getSize();
+
+                bool scrolled = texture_size.x > max_layer_window_size || texture_size.y > max_layer_window_size;
+
+                if (scrolled)
+                    ImGui::SetNextWindowSize(ImVec2(max_layer_window_size, max_layer_window_size), ImGuiCond_FirstUseEver);
+
+                // Collapsed windows are not drawn, and their layers not subscribed to
+                if (ImGui::Begin(desc.name.c_str(), &open, scrolled ? ImGuiWindowFlags_HorizontalScrollbar : ImGuiWindowFlags_AlwaysAutoResize)) {
+                    layer_visible[l] = true;
+
+                    // Columns within the window, the texture shows the last row of columns at the top
+                    ImVec2 image_pos = ImGui::GetCursorScreenPos();
+                    ImVec2 window_pos = ImGui::GetWindowPos();
+                    ImVec2 window_size = ImGui::GetWindowSize();
+
+                    float column_pixels = static_cast<float>(texture_size.x) / desc.width;
+
+                    int width = desc.width;
+                    int height = desc.height;
+
+                    sf::Vector2i lower(
+                        std::max(0, static_cast<int>(std::floor((window_pos.x - image_pos.x) / column_pixels))),
+                        std::max(0, height - static_cast<int>(std::ceil((window_pos.y + window_size.y - image_pos.y) / column_pixels))));
+
+                    sf::Vector2i upper(
+                        std::min(width, static_cast<int>(std::ceil((window_pos.x + window_size.x - image_pos.x) / column_pixels))),
+                        std::min(height, height - static_cast<int>(std::floor((window_pos.y - image_pos.y) / column_pixels))));
+
+                    upper.x = std::max(lower.x, upper.x);
+                    upper.y = std::max(lower.y, upper.y);
+
+                    if (lower.x == 0 && lower.y == 0 && upper.x == width && upper.y == height)
+                        layer_rois[l] = { 0, 0, 0, 0 };
+                    else
+                        layer_rois[l] = { static_cast<std::uint32_t>(lower.x), static_cast<std::uint32_t>(lower.y), static_cast<std::uint32_t>(upper.x - lower.x), static_cast<std::uint32_t>(upper.y - lower.y) };
+
+                    const CSDR &csdr = network.csdrs[l];
+
+                    // Unchanged layers still hold the same buffer
+                    if (csdr.indices != shown_csdrs[l].indices && csdr.indices != nullptr) {
+                        const std::vector<std::int32_t> &indices = *csdr.indices;
+
+                        for (int i = 0; i < indices.size(); i++)
+                            layer_CSDR_vis[l][i] = indices[i];
+
+                        shown_csdrs[l] = csdr;
+                    }
+
+                    layer_CSDR_vis[l].draw(lower, upper);
+
+                    bool hovering;
+                    int hover_x = -1;
+                    int hover_y = -1;
+
+                    ImGui::ImageHover(layer_CSDR_vis[l].get_texture(), hovering, hover_x, hover_y, ImVec2(layer_CSDR_vis[l].get_texture().getSize().x, layer_CSDR_vis[l].get_texture().getSize().y));
+
+                    if (hovering) {
+                        if (sf::Mouse::isButtonPressed(sf::Mouse::Button::Right)) {
+                            // Divide by size
+                            layer_CSDR_vis[l].highlight_x = static_cast<int>(hover_x / layer_CSDR_vis[l].node_space_size);
+                            layer_CSDR_vis[l].highlight_y = layer_CSDR_vis[l].get_size_in_nodes().y - static_cast<int>(hover_y / layer_CSDR_vis[l].node_space_size + 1.0f);
+
+                            caret.pos = layer_CSDR_vis[l].get_highlighted_CSDR_pos();
+                            caret.layer = l;
+                        }
+
+                        // Middle click pins the cell, to compare its fields with other cells' side by side
+                        if (ImGui::IsMouseClicked(ImGuiMouseButton_Middle) && pins.size() < max_pins) {
+                            Caret pin;
+
+                            pin.layer = l;
+                            pin.pos = layer_CSDR_vis[l].get_CSDR_pos(static_cast<int>(hover_x / layer_CSDR_vis[l].node_space_size),
+                                layer_CSDR_vis[l].get_size_in_nodes().y - static_cast<int>(hover_y / layer_CSDR_vis[l].node_space_size + 1.0f));
+
+                            if (pin.pos.z >= 0) {
+                                pins.push_back(pin);
+
+                                pins_dirty = true;
+                            }
+                        }
+                    }
+                    else {
+                        layer_CSDR_vis[l].highlight_x = -1;
+                        layer_CSDR_vis[l].highlight_y = -1;
+                    }
+                }
+
+                ImGui::End();
+
+                layer_open[l] = open;
+            }
+
+            // Show contents of caret position
+            field_textures.resize(network.fields.size());
+            field_texture_versions.resize(network.fields.size(), 0);
+            field_texture_zs.resize(network.fields.size(), -1);
+            field_zs.resize(network.fields.size(), 0);
+
+            // Whether the fields come from a pre-encoder, so can be shown as RGB
+            bool fields_rgb = network.topology != nullptr && network.fields_layer < network.topology->num_encs;
+
+            for (int i = 0; i < network.fields.size(); i++) {
+                sf::Vector3i field_size = sf::Vector3i(network.fields[i].field_size_x, network.fields[i].field_size_y, network.fields[i].field_size_z);
+
+                // Make sure is in range
+                field_zs[i] = std::min(field_size.z - 1, std::max(0, field_zs[i]));
+
+                const Field &field = network.fields[i];
+
+                // If can use RGB for pre-encoder
+                bool rgb = field_size.z == 3 && fields_rgb;
+
+                // Only redraw when the field or the shown Z changed
+                if (field_texture_versions[i] != field.version || field_texture_zs[i] != field_zs[i]) {
+                    int empty = (field_size.x * field_size.y * field_size.z) == 0;
+
+                    // A delta on top of what is shown only needs the texels it touched redrawn
+                    bool patch = !empty && field.base_version != 0 && field.base_version == field_texture_versions[i] && field_texture_zs[i] == field_zs[i];
+
+                    if (patch) {
+                        if (field.dirty_upper.x >= field.dirty_lower.x) {
+                            sf::Image dirty_img(sf::Vector2u(field.dirty_upper.x - field.dirty_lower.x + 1, field.dirty_upper.y - field.dirty_lower.y + 1), sf::Color::Black);
+
+                            for (int x = 0; x < dirty_img.getSize().x; x++)
+                                for (int y = 0; y < dirty_img.getSize().y; y++)
+                                    dirty_img.setPixel(sf::Vector2u(x, y), get_field_color(field, field.dirty_lower.x + x, field.dirty_lower.y + y, field_zs[i], rgb));
+
+                            field_textures[i].update(dirty_img, sf::Vector2u(field.dirty_lower.x, field.dirty_lower.y));
+                        }
+                    }
+                    else {
+                        field_textures[i] = sf::Texture(get_field_image(field, field_zs[i], rgb));
+
+                        field_textures[i].setSmooth(false);
+                    }
+
+                    field_texture_versions[i] = field.version;
+                    field_texture_zs[i] = field_zs[i];
+                }
+
+                std::string name = network.topology->layers[network.fields_layer].visible_layers[i].name;
+
+                ImGui::Begin(name.c_str(), nullptr, ImGuiWindowFlags_AlwaysAutoResize);
+
+                bool hovering;
+                int hover_x = -1;
+                int hover_y = -1;
+
+                ImGui::ImageHover(field_textures[i], hovering, hover_x, hover_y, ImVec2(8.0f * field_textures[i].getSize().x, 8.0f * field_textures[i].getSize().y));
+
+                if (hovering) {
+                    // Select field Z
+                    field_zs[i] = std::min(network.fields[i].field_size_z - 1, std::max(0, field_zs[i] + mouse_wheel_delta));
+
+                    ImGui::BeginTooltip();
+
+                    if ((network.fields[i].field_size_z == 3 || network.fields[i].field_size_z == 6) && fields_rgb)
+                        ImGui::SetTooltip("RGB");
+                    else
+                        ImGui::SetTooltip(("Z: " + std::to_string(field_zs[i])).c_str());
+
+                    ImGui::EndTooltip();
+                }
+
+                ImGui::End();
+            }
+
+            // Pinned cells side by side, each with its fields one above the other
+            if (!pins.empty() && network.pins_id == pins_id && network.topology != nullptr) {
+                pin_textures.resize(pins.size());
+                pin_texture_versions.resize(pins.size());
+
+                bool open = true;
+
+                int unpinned = -1;
+
+                if (ImGui::Begin("Pinned", &open, ImGuiWindowFlags_AlwaysAutoResize)) {
+                    for (int p = 0; p < pins.size() && p < network.pinned_fields.size(); p++) {
+                        const std::vector<Field> &fields = network.pinned_fields[p];
+
+                        if (p > 0)
+                            ImGui::SameLine();
+
+                        ImGui::BeginGroup();
+                        ImGui::PushID(p);
+
+                        bool in_topology = pins[p].layer < network.topology->layers.size();
+
+                        ImGui::Text("%s (%d, %d, %d)", in_topology ? network.topology->layers[pins[p].layer].name.c_str() : "?", pins[p].pos.x, pins[p].pos.y, pins[p].pos.z);
+
+                        if (ImGui::SmallButton("Unpin"))
+                            unpinned = p;
+
+                        pin_textures[p].resize(fields.size());
+                        pin_texture_versions[p].resize(fields.size(), 0);
+
+                        for (int f = 0; f < fields.size(); f++) {
+                            const Field &field = fields[f];
+
+                            if (pin_texture_versions[p][f] != field.version) {
+                                bool rgb = field.field_size_z == 3 && pins[p].layer < network.topology->num_encs;
+
+                                pin_textures[p][f] = sf::Texture(get_field_image(field, 0, rgb));
+
+                                pin_textures[p][f].setSmooth(false);
+
+                                pin_texture_versions[p][f] = field.version;
+                            }
+
+                            ImGui::Image(pin_textures[p][f], sf::Vector2f(8.0f * pin_textures[p][f].getSize().x, 8.0f * pin_textures[p][f].getSize().y));
+                        }
+
+                        ImGui::PopID();
+                        ImGui::EndGroup();
+                    }
+                }
+
+                ImGui::End();
+
+                if (!open)
+                    pins.clear();
+                else if (unpinned >= 0)
+                    pins.erase(pins.begin() + unpinned);
+
+                if (!open || unpinned >= 0) {
+                    pins_dirty = true;
+
+                    pin_textures.clear();
+                    pin_texture_versions.clear();
+                }
             }
         }
 
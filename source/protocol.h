@@ -0,0 +1,317 @@
+// ----------------------------------------------------------------------------
+//  NeoVis
+//  Copyright(c) 2017-2024 Ogma Intelligent Systems Corp. All rights reserved.
+//
+//  This copy of NeoVis is licensed to you under the terms described
+//  in the NEOVIS_LICENSE.md file included in this distribution.
+// ----------------------------------------------------------------------------
+
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <vector>
+
+// Wire format shared by NeoVis and the visualization adapters (visadapter.cpp, visadapter.py).
+// Everything is little-endian and read and written in place, so hosts have to be too
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#error "NeoVis's wire format needs a little-endian host"
+#endif
+
+const std::uint32_t frame_magic = 0x5349564e; // "NVIS" when read as bytes
+const std::uint16_t protocol_version = 12;
+
+// Anything claiming to be larger than this is treated as a corrupted header
+const std::uint32_t max_frame_size = 1u << 28;
+
+// Dimensions and counts are LEB128 varints of at most 32 bits, so small hierarchies stay compact
+const size_t max_varint_size = 5;
+
+// Every message is sent as a header followed by size bytes of body
+struct Frame_Header {
+    std::uint32_t magic;
+    std::uint16_t version;
+    std::uint8_t type; // Message_Type
+    std::uint8_t flags;
+    std::uint32_t sequence; // Goes up by one with every message to a viewer, gaps mean lost messages
+    std::uint32_t size;
+    std::uint64_t timestamp; // Microseconds on the adapter's monotonic clock when the message was sent
+};
+
+static_assert(sizeof(Frame_Header) == 24, "Frame_Header must not be padded");
+
+enum Message_Type {
+    // Sent on connect and whenever the hierarchy's shape changes:
+    // 32-bit topology id, varint layer count, varint pre-encoder count, then per layer its name, varint width/height/column size
+    // and varint visible layer count, then per visible layer its name, varint size x/y/z and varint radius (0 if unknown).
+    // Names are a varint length followed by that many characters
+    message_topology = 0,
+
+    // Sent every update: 32-bit id of the topology it follows, then per layer an encoding byte and payload (no sizes, those are in the topology)
+    message_state = 1,
+
+    // Sent ahead of the state, and right away when the caret changes: 32-bit topology id, 32-bit id of the caret it answers (see command_set_caret),
+    // varint caret layer, varint field count, and per field (one per visible layer of the caret layer, in order)
+    // a Field_Status byte, followed (unless unchanged) by its varint size x/y/z, an encoding byte and payload
+    message_fields = 2,
+
+    // A chunk of the weights asked for with command_request_weights, sent after a state: 32-bit topology id, varint layer, varint first cell,
+    // varint cell count, varint total cells of the layer, then an encoding byte (field_encoding_raw) and payload holding per cell
+    // (z + column size * (y + height * x)) its fields, one per visible layer in order, each (radius * 2 + 1)^2 * size z raw weights
+    message_weights = 3,
+
+    // Fields of the pinned cells (see command_set_pins), sent along with states and right away when the pins change: 32-bit topology id,
+    // 32-bit id of the pins they answer, varint entry count, then per entry the varint index of its pin, varint field count and fields
+    // as in message_fields (diffed against the last ones sent for that pin). Entries need not come in pin order
+    message_pinned_fields = 4
+};
+
+// In UDP mode a message (header included) is split into chunks of max_datagram_payload bytes (the last one shorter),
+// each sent as a datagram led by this. Viewers keep only the newest message, one still missing chunks when a newer one starts is dropped
+struct Datagram_Header {
+    std::uint32_t magic;
+    std::uint32_t sequence; // Of the message, as in its Frame_Header. UDP messages are counted apart from those over TCP
+    std::uint16_t chunk;
+    std::uint16_t num_chunks;
+};
+
+static_assert(sizeof(Datagram_Header) == 12, "Datagram_Header must not be padded");
+
+// Small enough that datagrams are not fragmented on common links
+const size_t max_datagram_payload = 1400;
+
+// Codecs a viewer can decode, as a bit set
+const std::uint16_t codec_lz = 1 << 0;
+
+// Viewers talk to adapters in commands, each this header followed by size bytes of body.
+// Adapters skip commands they do not know
+struct Command_Header {
+    std::uint16_t size;
+    std::uint8_t type; // Command_Type
+    std::uint8_t reserved;
+};
+
+static_assert(sizeof(Command_Header) == 4, "Command_Header must not be padded");
+
+enum Command_Type {
+    command_hello = 0, // A Hello, must come first
+    command_set_caret = 1, // 16-bit layer, 8-bit field bits, 8-bit field pool (see max_field_bits), 32-bit x/y/z (-1 for none), 32-bit caret id
+    command_subscribe = 2, // Varint layer count, then that many bits (packed, see codec.h), 1 for each layer to send. Layers past the count are sent
+    command_set_max_rate = 3, // 32-bit float, most state messages per second to send (0 for no limit)
+    command_request_keyframe = 4, // No body, the next state message has every layer in full
+
+    // Varint layer, then varint x, y, width and height of the columns the viewer shows of it (width or height 0 for the whole layer).
+    // Adapters may then send just those columns (see csdr_encoding_roi), with the whole layer now and then
+    command_set_roi = 5,
+
+    // Varint layer whose weights to stream (see message_weights), from its first cell, a chunk at a time alongside states.
+    // A layer past the last cancels
+    command_request_weights = 6,
+
+    // 32-bit pins id, varint pin count (at most max_pins), then per pin its varint layer and x/y/z.
+    // Pinned cells get their fields sent alongside the caret's, with the caret's field bits and pooling
+    command_set_pins = 7,
+
+    // 16-bit UDP port (0 to go back to TCP only). State messages then go to that port of the viewer's address as datagrams
+    // (see Datagram_Header) instead of down the TCP stream, each with every layer in full so any one that arrives stands on its own
+    command_enable_udp = 8,
+
+    // 8-bit flag, 1 once the viewer mapped the adapter's shared memory ring (see Shm_Ring, named "/neovis_" followed by the adapter's port), 0 to go back.
+    // State messages then go into the ring instead of down the TCP stream, with every layer in full as readers only see the newest.
+    // Adapters that have no ring ignore it and keep sending states over TCP
+    command_enable_shm = 9
+};
+
+// Body of command_hello
+struct Hello {
+    std::uint32_t magic;
+    std::uint16_t version;
+    std::uint16_t codecs;
+    std::uint8_t reserved[8];
+};
+
+static_assert(sizeof(Hello) == 16, "Hello must not be padded");
+
+// Set on a block's encoding byte when its payload is LZ compressed (only for viewers that announced codec_lz).
+// A compressed payload is its 32-bit uncompressed size, 32-bit compressed size and the compressed bytes
+const std::uint8_t encoding_compressed = 0x80;
+
+// How a layer's column indices are encoded.
+// Packed values are bits_for(n) bits each (see codec.h), n being the column size for indices and width * height for columns
+enum CSDR_Encoding {
+    csdr_encoding_raw = 0, // One 16-bit index per column
+    csdr_encoding_delta = 1, // Varint count, then packed columns and packed indices of the columns that changed since the previous frame
+    csdr_encoding_packed = 2, // One packed index per column
+    csdr_encoding_raw32 = 3, // One 32-bit index per column
+    csdr_encoding_skipped = 4, // No payload, the viewer did not subscribe to the layer and keeps what it has
+
+    // Varint x, y, width and height of a rectangle of columns, then their packed indices (column by column like the layer),
+    // the rest of the layer stays as the viewer has it. Only sent to viewers that asked for it with command_set_roi
+    csdr_encoding_roi = 5
+};
+
+// Leads every field of a state message
+enum Field_Status {
+    field_changed = 0, // Size, encoding and payload follow
+    field_unchanged = 1 // Nothing follows, the field is the same as the last one sent at this index
+};
+
+// How a field's weights follow its size
+enum Field_Encoding {
+    field_encoding_raw = 0, // One byte per weight
+    field_encoding_quantized = 1, // A byte giving the bit depth (1 to 7), then the top that many bits of each weight, packed
+
+    // Against the last field sent at this index, which must have the same size: varint run count, then per run a varint count of unchanged weights
+    // to skip, a varint count of changed weights and that many bytes to XOR them with
+    field_encoding_xor_rle = 2
+};
+
+// A viewer asks for a reduced field through command_set_caret: the bit depth to quantize weights to (8 for full precision)
+// and the width of the square of weights to average into one (1 for no pooling). Adapters may ignore either, the field's size and encoding say what was sent
+const int max_field_bits = 8;
+
+// Most cells a viewer can pin at once
+const int max_pins = 16;
+
+// Bounds-checked cursor over a received frame body, parses in place
+class Frame_Reader {
+private:
+    const unsigned char* data;
+    size_t size;
+    size_t pos;
+
+    bool valid;
+
+public:
+    Frame_Reader(const unsigned char* data, size_t size)
+    :
+    data(data),
+    size(size),
+    pos(0),
+    valid(true)
+    {}
+
+    template<class T>
+    T read() {
+        T value = T();
+
+        if (pos + sizeof(T) > size) {
+            valid = false;
+
+            return value;
+        }
+
+        std::memcpy(&value, &data[pos], sizeof(T));
+
+        pos += sizeof(T);
+
+        return value;
+    }
+
+    std::uint32_t read_varint() {
+        std::uint32_t value = 0;
+
+        for (int shift = 0; shift < 35; shift += 7) {
+            std::uint8_t b = read<std::uint8_t>();
+
+            value |= static_cast<std::uint32_t>(b & 0x7f) << shift;
+
+            if ((b & 0x80) == 0)
+                return value;
+        }
+
+        // Longer than any 32-bit value
+        valid = false;
+
+        return 0;
+    }
+
+    // Returns a pointer to the next count bytes and moves past them, nullptr if out of range
+    const unsigned char* skip(size_t count) {
+        if (count > size - pos) {
+            valid = false;
+
+            return nullptr;
+        }
+
+        const unsigned char* start = &data[pos];
+
+        pos += count;
+
+        return start;
+    }
+
+    size_t get_remaining() const {
+        return size - pos;
+    }
+
+    bool is_valid() const {
+        return valid;
+    }
+};
+
+// Serializes frames into a buffer that is kept between frames, so steady state does not allocate
+class Frame_Writer {
+private:
+    std::vector<unsigned char> buffer;
+    size_t size;
+
+public:
+    Frame_Writer()
+    :
+    size(0)
+    {}
+
+    // Empties the writer, making room for capacity bytes up front
+    void clear(size_t capacity = 0) {
+        size = 0;
+
+        if (buffer.size() < capacity)
+            buffer.resize(capacity);
+    }
+
+    // Appends count bytes for the caller to fill in and returns where they start
+    unsigned char* add(size_t count) {
+        if (size + count > buffer.size())
+            buffer.resize(size + count > buffer.size() * 2 ? size + count : buffer.size() * 2);
+
+        unsigned char* start = buffer.data() + size;
+
+        size += count;
+
+        return start;
+    }
+
+    template<class T>
+    void push(T value) {
+        std::memcpy(add(sizeof(T)), &value, sizeof(T));
+    }
+
+    void push_varint(std::uint32_t value) {
+        while (value >= 0x80) {
+            push<std::uint8_t>(static_cast<std::uint8_t>(value | 0x80));
+
+            value >>= 7;
+        }
+
+        push<std::uint8_t>(static_cast<std::uint8_t>(value));
+    }
+
+    void push_bytes(const void* src, size_t count) {
+        if (count > 0)
+            std::memcpy(add(count), src, count);
+    }
+
+    unsigned char* get_data() {
+        return buffer.data();
+    }
+
+    const unsigned char* get_data() const {
+        return buffer.data();
+    }
+
+    size_t get_size() const {
+        return size;
+    }
+};
@@ -0,0 +1,217 @@
+// ----------------------------------------------------------------------------
+//  NeoVis
+//  Copyright(c) 2017-2024 Ogma Intelligent Systems Corp. All rights reserved.
+//
+//  This copy of NeoVis is licensed to you under the terms described
+//  in the NEOVIS_LICENSE.md file included in this distribution.
+// ----------------------------------------------------------------------------
+
+#include "shm_ring.h"
+#include "protocol.h"
+
+#include <cstring>
+#include <new>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define NEOVIS_SHM
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+// Header and every slot start on their own cache line
+static const size_t shm_alignment = 64;
+
+static size_t align_up(size_t size) {
+    return (size + shm_alignment - 1) / shm_alignment * shm_alignment;
+}
+
+Shm_Ring::Slot* Shm_Ring::get_slot(int index) const {
+    size_t stride = align_up(sizeof(Slot) + get_header()->slot_size);
+
+    return reinterpret_cast<Slot*>(mapping + align_up(sizeof(Header)) + index * stride);
+}
+
+bool Shm_Ring::create(const std::string &name, int num_slots, size_t slot_size) {
+#ifdef NEOVIS_SHM
+    // Readers of the ring being replaced find the new one under the same name
+    if (mapping != nullptr && owner)
+        get_header()->closed.store(1, std::memory_order_release);
+
+    close();
+
+    size_t size = align_up(sizeof(Header)) + num_slots * align_up(sizeof(Slot) + slot_size);
+
+    int fd = shm_open(name.c_str(), O_CREAT | O_RDWR | O_TRUNC, 0600);
+
+    if (fd == -1)
+        return false;
+
+    void* address = MAP_FAILED;
+
+    if (ftruncate(fd, size) == 0)
+        address = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+    ::close(fd);
+
+    if (address == MAP_FAILED) {
+        shm_unlink(name.c_str());
+
+        return false;
+    }
+
+    this->name = name;
+
+    mapping = static_cast<unsigned char*>(address);
+    mapping_size = size;
+    owner = true;
+
+    Header* header = new (mapping) Header();
+
+    header->num_slots = num_slots;
+    header->slot_size = slot_size;
+    header->closed.store(0, std::memory_order_relaxed);
+    header->num_written.store(0, std::memory_order_relaxed);
+
+    for (int i = 0; i < num_slots; i++) {
+        Slot* slot = new (get_slot(i)) Slot();
+
+        slot->seq.store(0, std::memory_order_relaxed);
+        slot->size = 0;
+    }
+
+    // Readers check the magic last, once everything else is in place
+    std::atomic_thread_fence(std::memory_order_release);
+
+    header->magic = frame_magic;
+
+    return true;
+#else
+    return false;
+#endif
+}
+
+bool Shm_Ring::open(const std::string &name) {
+#ifdef NEOVIS_SHM
+    close();
+
+    // Readers only ever look
+    int fd = shm_open(name.c_str(), O_RDONLY, 0);
+
+    if (fd == -1)
+        return false;
+
+    struct stat info;
+
+    void* address = MAP_FAILED;
+
+    if (fstat(fd, &info) == 0 && info.st_size >= static_cast<off_t>(align_up(sizeof(Header))))
+        address = mmap(nullptr, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+
+    ::close(fd);
+
+    if (address == MAP_FAILED)
+        return false;
+
+    this->name = name;
+
+    mapping = static_cast<unsigned char*>(address);
+    mapping_size = info.st_size;
+    owner = false;
+
+    Header* header = get_header();
+
+    std::atomic_thread_fence(std::memory_order_acquire);
+
+    // Not (yet) a ring, or one that claims more than was mapped
+    if (header->magic != frame_magic || header->num_slots == 0 ||
+        align_up(sizeof(Header)) + header->num_slots * align_up(sizeof(Slot) + header->slot_size) > mapping_size) {
+        close();
+
+        return false;
+    }
+
+    return true;
+#else
+    return false;
+#endif
+}
+
+void Shm_Ring::close() {
+#ifdef NEOVIS_SHM
+    if (mapping == nullptr)
+        return;
+
+    munmap(mapping, mapping_size);
+
+    if (owner)
+        shm_unlink(name.c_str());
+
+    mapping = nullptr;
+    mapping_size = 0;
+    owner = false;
+#endif
+}
+
+bool Shm_Ring::write(const unsigned char* data, size_t size) {
+    Header* header = get_header();
+
+    if (size > header->slot_size)
+        return false;
+
+    std::uint64_t num_written = header->num_written.load(std::memory_order_relaxed);
+
+    Slot* slot = get_slot(num_written % header->num_slots);
+
+    std::uint64_t seq = slot->seq.load(std::memory_order_relaxed);
+
+    // Odd tells readers still parsing the old message that it is going away
+    slot->seq.store(seq + 1, std::memory_order_relaxed);
+
+    std::atomic_thread_fence(std::memory_order_release);
+
+    slot->size = size;
+
+    std::memcpy(reinterpret_cast<unsigned char*>(slot) + sizeof(Slot), data, size);
+
+    slot->seq.store(seq + 2, std::memory_order_release);
+
+    header->num_written.store(num_written + 1, std::memory_order_release);
+
+    return true;
+}
+
+const unsigned char* Shm_Ring::read_latest(std::uint64_t &num_read, size_t &size, int &slot, std::uint64_t &seq) const {
+    Header* header = get_header();
+
+    std::uint64_t num_written = header->num_written.load(std::memory_order_acquire);
+
+    if (num_written == num_read)
+        return nullptr;
+
+    slot = (num_written - 1) % header->num_slots;
+
+    Slot* s = get_slot(slot);
+
+    seq = s->seq.load(std::memory_order_acquire);
+
+    // Already being overwritten by a newer one, which is read next time
+    if (seq % 2 != 0)
+        return nullptr;
+
+    size = s->size;
+
+    if (size > header->slot_size)
+        return nullptr;
+
+    num_read = num_written;
+
+    return reinterpret_cast<const unsigned char*>(s) + sizeof(Slot);
+}
+
+bool Shm_Ring::is_intact(int slot, std::uint64_t seq) const {
+    std::atomic_thread_fence(std::memory_order_acquire);
+
+    return get_slot(slot)->seq.load(std::memory_order_relaxed) == seq;
+}
@@ -0,0 +1,100 @@
+// ----------------------------------------------------------------------------
+//  NeoVis
+//  Copyright(c) 2017-2024 Ogma Intelligent Systems Corp. All rights reserved.
+//
+//  This copy of NeoVis is licensed to you under the terms described
+//  in the NEOVIS_LICENSE.md file included in this distribution.
+// ----------------------------------------------------------------------------
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+#include <string>
+
+// Latest-wins ring of messages in POSIX shared memory, so a viewer on the adapter's host gets states without going through sockets.
+// One writer, any number of readers. Every slot is guarded by a seqlock: readers parse a message where it lies, then check the slot
+// was not rewritten meanwhile. Where there is no POSIX shared memory, create and open fail and viewers stay on TCP
+class Shm_Ring {
+private:
+    struct Header {
+        std::uint32_t magic;
+        std::uint32_t num_slots;
+        std::uint64_t slot_size;
+
+        std::atomic<std::uint32_t> closed; // Set before the writer replaces the ring, readers then open it again
+        std::atomic<std::uint64_t> num_written;
+    };
+
+    struct Slot {
+        std::atomic<std::uint64_t> seq; // Odd while the slot is being written
+        std::uint64_t size;
+    };
+
+    static_assert(std::atomic<std::uint64_t>::is_always_lock_free, "Atomics in shared memory must be lock-free");
+
+    std::string name;
+
+    unsigned char* mapping;
+    size_t mapping_size;
+
+    bool owner;
+
+    Header* get_header() const {
+        return reinterpret_cast<Header*>(mapping);
+    }
+
+    Slot* get_slot(int index) const;
+
+public:
+    Shm_Ring()
+    :
+    mapping(nullptr),
+    mapping_size(0),
+    owner(false)
+    {}
+
+    ~Shm_Ring() {
+        close();
+    }
+
+    Shm_Ring(const Shm_Ring &) = delete;
+    Shm_Ring &operator=(const Shm_Ring &) = delete;
+
+    // Writer: (re)creates the ring under name (such as "/neovis_54000"), telling readers of a ring it replaces to open it again
+    bool create(const std::string &name, int num_slots, size_t slot_size);
+
+    // Reader: maps the ring the writer created under name
+    bool open(const std::string &name);
+
+    // Unmaps the ring, and removes it if this created it
+    void close();
+
+    bool is_open() const {
+        return mapping != nullptr;
+    }
+
+    const std::string &get_name() const {
+        return name;
+    }
+
+    size_t get_slot_size() const {
+        return mapping == nullptr ? 0 : get_header()->slot_size;
+    }
+
+    // Writer: copies a message into the next slot, false if it does not fit
+    bool write(const unsigned char* data, size_t size);
+
+    // Reader: the newest message if more were written than num_read (then updated), nullptr otherwise.
+    // slot and seq are for is_intact, the message is only to be trusted if it says so once done with it
+    const unsigned char* read_latest(std::uint64_t &num_read, size_t &size, int &slot, std::uint64_t &seq) const;
+
+    // Whether the slot still holds the message read_latest returned
+    bool is_intact(int slot, std::uint64_t seq) const;
+
+    // Whether the writer replaced the ring, which is then to be opened again
+    bool is_closed() const {
+        return mapping != nullptr && get_header()->closed.load(std::memory_order_acquire) != 0;
+    }
+};
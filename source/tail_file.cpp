@@ -0,0 +1,164 @@
+// ----------------------------------------------------------------------------
+//  NeoVis
+//  Copyright(c) 2017-2024 Ogma Intelligent Systems Corp. All rights reserved.
+//
+//  This copy of NeoVis is licensed to you under the terms described
+//  in the NEOVIS_LICENSE.md file included in this distribution.
+// ----------------------------------------------------------------------------
+
+#include "tail_file.h"
+#include "protocol.h"
+
+#include <cstring>
+#include <new>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define NEOVIS_TAIL_FILE
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+// Messages start on their own cache line past the header
+static const size_t messages_offset = 64;
+
+bool Tail_File::create(const std::string &path, size_t capacity) {
+#ifdef NEOVIS_TAIL_FILE
+    static_assert(sizeof(Header) <= messages_offset, "Tail_File header must fit before the messages");
+
+    close();
+
+    size_t size = messages_offset + capacity;
+
+    // A file already there is unlinked rather than truncated, so viewers still mapping it keep theirs intact instead of faulting
+    unlink(path.c_str());
+
+    fd = ::open(path.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644);
+
+    if (fd == -1)
+        return false;
+
+    void* address = MAP_FAILED;
+
+    if (ftruncate(fd, size) == 0)
+        address = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+    if (address == MAP_FAILED) {
+        ::close(fd);
+
+        fd = -1;
+
+        return false;
+    }
+
+    mapping = static_cast<unsigned char*>(address);
+    mapping_size = size;
+
+    Header* header = new (mapping) Header();
+
+    header->version = protocol_version;
+    header->reserved = 0;
+    header->capacity = capacity;
+    header->cursor.store(0, std::memory_order_relaxed);
+
+    // Readers check the magic last, once everything else is in place
+    std::atomic_thread_fence(std::memory_order_release);
+
+    header->magic = frame_magic;
+
+    return true;
+#else
+    return false;
+#endif
+}
+
+bool Tail_File::open(const std::string &path) {
+#ifdef NEOVIS_TAIL_FILE
+    close();
+
+    int file = ::open(path.c_str(), O_RDONLY);
+
+    if (file == -1)
+        return false;
+
+    struct stat info;
+
+    void* address = MAP_FAILED;
+
+    if (fstat(file, &info) == 0 && info.st_size >= static_cast<off_t>(messages_offset))
+        address = mmap(nullptr, info.st_size, PROT_READ, MAP_SHARED, file, 0);
+
+    // The mapping stays valid without it
+    ::close(file);
+
+    if (address == MAP_FAILED)
+        return false;
+
+    mapping = static_cast<unsigned char*>(address);
+    mapping_size = info.st_size;
+
+    Header* header = get_header();
+
+    std::atomic_thread_fence(std::memory_order_acquire);
+
+    // Not a recording, or one this viewer cannot read
+    if (header->magic != frame_magic || header->version != protocol_version || messages_offset + get_cursor() > mapping_size) {
+        close();
+
+        return false;
+    }
+
+    return true;
+#else
+    return false;
+#endif
+}
+
+bool Tail_File::close() {
+#ifdef NEOVIS_TAIL_FILE
+    if (mapping == nullptr)
+        return true;
+
+    size_t size = messages_offset + get_cursor();
+
+    munmap(mapping, mapping_size);
+
+    bool trimmed = true;
+
+    if (fd != -1) {
+        // Only what was written is kept
+        trimmed = ftruncate(fd, size) == 0;
+
+        ::close(fd);
+
+        fd = -1;
+    }
+
+    mapping = nullptr;
+    mapping_size = 0;
+
+    return trimmed;
+#else
+    return true;
+#endif
+}
+
+bool Tail_File::append(const unsigned char* data, size_t size) {
+    Header* header = get_header();
+
+    std::uint64_t cursor = header->cursor.load(std::memory_order_relaxed);
+
+    if (cursor + size > header->capacity)
+        return false;
+
+    std::memcpy(mapping + messages_offset + cursor, data, size);
+
+    header->cursor.store(cursor + size, std::memory_order_release);
+
+    return true;
+}
+
+const unsigned char* Tail_File::get_messages() const {
+    return mapping + messages_offset;
+}
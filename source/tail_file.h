@@ -0,0 +1,78 @@
+// ----------------------------------------------------------------------------
+//  NeoVis
+//  Copyright(c) 2017-2024 Ogma Intelligent Systems Corp. All rights reserved.
+//
+//  This copy of NeoVis is licensed to you under the terms described
+//  in the NEOVIS_LICENSE.md file included in this distribution.
+// ----------------------------------------------------------------------------
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+#include <string>
+
+// Preallocated, memory mapped file messages (Frame_Header and body) are appended to one after another, a recording that can be
+// read while it is written. The write cursor only moves past a message once it is all there, so readers never see part of one.
+// Once closed the file is cut down to what was written, and can be read from the start again. POSIX only, create and open fail elsewhere
+class Tail_File {
+private:
+    struct Header {
+        std::uint32_t magic;
+        std::uint16_t version;
+        std::uint16_t reserved;
+        std::uint64_t capacity; // Bytes of messages the file was preallocated for
+
+        std::atomic<std::uint64_t> cursor; // Bytes of messages written
+    };
+
+    static_assert(std::atomic<std::uint64_t>::is_always_lock_free, "Atomics in a shared mapping must be lock-free");
+
+    int fd; // Kept by the writer to cut the file down when done
+
+    unsigned char* mapping;
+    size_t mapping_size;
+
+    Header* get_header() const {
+        return reinterpret_cast<Header*>(mapping);
+    }
+
+public:
+    Tail_File()
+    :
+    fd(-1),
+    mapping(nullptr),
+    mapping_size(0)
+    {}
+
+    ~Tail_File() {
+        close();
+    }
+
+    Tail_File(const Tail_File &) = delete;
+    Tail_File &operator=(const Tail_File &) = delete;
+
+    // Writer: creates (or replaces, leaving readers of the old one be) the file at path with room for capacity bytes of messages
+    bool create(const std::string &path, size_t capacity);
+
+    // Reader: maps the file at path, whether it is still being written or not
+    bool open(const std::string &path);
+
+    // False if the writer could not cut the file down, it then keeps its preallocated size (readers still stop at the cursor)
+    bool close();
+
+    bool is_open() const {
+        return mapping != nullptr;
+    }
+
+    // Writer: appends a message, false once the file is full
+    bool append(const unsigned char* data, size_t size);
+
+    // Bytes of messages that can be read, from get_messages()
+    std::uint64_t get_cursor() const {
+        return get_header()->cursor.load(std::memory_order_acquire);
+    }
+
+    const unsigned char* get_messages() const;
+};
@@ -7,317 +7,2015 @@
 // ----------------------------------------------------------------------------
 
 #include "visadapter.h"
+#include "codec.h"
 
+#include <algorithm>
 #include <iostream>
+#include <limits>
 
-const int field_name_size = 64;
+// Weights chunks stop growing past this many bytes, so they never hold back the next state for long
+const size_t weights_chunk_size = 1 << 16;
 
-void get_receptive_field(
-    const Image_Encoder &enc,
-    int vli,
-    const Int3 &pos,
-    std::vector<unsigned char> &field,
-    Int3 &field_size
+// Readers only ever want the newest slot, the others give a slow one time to finish before it is overwritten
+const int ring_slots = 4;
+
+// Milliseconds between polls of the clients while no updates come
+const int network_poll_interval = 10;
+
+// Set on the middle snapshot's index while the thread has not taken it yet
+const int snapshot_fresh = 4;
+
+// A download starting over gets a new copy of the layer's weights at most this often, else it reuses the last one
+const sf::Time weights_copy_interval = sf::seconds(1.0f);
+
+// How long a send may make no progress before the client is given up on
+const sf::Time send_timeout = sf::seconds(2.0f);
+
+// Averages the pooled weight sums into field, each over the pool x pool square (clipped to diam) it covers
+void average_pooled_field(
+    const std::vector<int> &sums,
+    int diam,
+    int depth,
+    int pool,
+    std::vector<unsigned char> &field
 ) {
-    int num_visible_layers = enc.get_num_visible_layers();
+    int pooled_diam = (diam + pool - 1) / pool;
 
-    const aon::Image_Encoder::Visible_Layer &vl = enc.get_visible_layer(vli);
-    const aon::Image_Encoder::Visible_Layer_Desc &vld = enc.get_visible_layer_desc(vli);
+    field.resize(sums.size());
 
-    const aon::Int3 &hidden_size = enc.get_hidden_size();
+    for (int px = 0; px < pooled_diam; px++)
+        for (int py = 0; py < pooled_diam; py++) {
+            int count = (std::min(diam, (px + 1) * pool) - px * pool) * (std::min(diam, (py + 1) * pool) - py * pool);
 
-    int diam = vld.radius * 2 + 1;
-    int area = diam * diam;
+            int start = depth * (py + pooled_diam * px);
+
+            for (int vc = 0; vc < depth; vc++)
+                field[start + vc] = static_cast<unsigned char>(sums[start + vc] / count);
+        }
+}
 
-    aon::Int2 column_pos(pos.x, pos.y);
+// Where a hidden column's receptive field onto a visible layer lies, the same for every cell of the column
+void get_field_bounds(
+    const Int3 &hidden_size,
+    const Int3 &visible_size,
+    int radius,
+    const Int2 &column_pos,
+    Field_Bounds &bounds
+) {
+    bounds.diam = radius * 2 + 1;
 
-    int hidden_column_index = aon::address2(column_pos, aon::Int2(hidden_size.x, hidden_size.y));
-    int hidden_cells_start = hidden_size.z * hidden_column_index;
+    bounds.hidden_column_index = aon::address2(column_pos, aon::Int2(hidden_size.x, hidden_size.y));
 
     // projection
-    aon::Float2 h_to_v = aon::Float2(static_cast<float>(vld.size.x) / static_cast<float>(hidden_size.x),
-            static_cast<float>(vld.size.y) / static_cast<float>(hidden_size.y));
+    aon::Float2 h_to_v = aon::Float2(static_cast<float>(visible_size.x) / static_cast<float>(hidden_size.x),
+            static_cast<float>(visible_size.y) / static_cast<float>(hidden_size.y));
 
     aon::Int2 visible_center = project(column_pos, h_to_v);
 
         // lower corner
-    aon::Int2 field_lower_bound(visible_center.x - vld.radius, visible_center.y - vld.radius);
+    bounds.field_lower_bound = aon::Int2(visible_center.x - radius, visible_center.y - radius);
 
         // bounds of receptive field, clamped to input size
-    aon::Int2 iter_lower_bound(aon::max(0, field_lower_bound.x), aon::max(0, field_lower_bound.y));
-    aon::Int2 iter_upper_bound(aon::min(vld.size.x - 1, visible_center.x + vld.radius), aon::min(vld.size.y - 1, visible_center.y + vld.radius));
+    bounds.iter_lower_bound = aon::Int2(aon::max(0, bounds.field_lower_bound.x), aon::max(0, bounds.field_lower_bound.y));
+    bounds.iter_upper_bound = aon::Int2(aon::min(visible_size.x - 1, visible_center.x + radius), aon::min(visible_size.y - 1, visible_center.y + radius));
+}
+
+// Sizes of every layer (pre-encoders first) out of a topology signature
+void get_layer_layouts(
+    const std::vector<int> &signature,
+    std::vector<Layer_Layout> &layouts
+) {
+    int pos = 0;
+
+    int num_encs = signature[pos++];
+    int num_layers = num_encs + signature[pos++];
+
+    layouts.resize(num_layers);
+
+    for (int l = 0; l < num_layers; l++) {
+        Layer_Layout &layout = layouts[l];
+
+        layout.image_encoder = l < num_encs;
+
+        layout.hidden_size.x = signature[pos++];
+        layout.hidden_size.y = signature[pos++];
+        layout.hidden_size.z = signature[pos++];
+
+        layout.visible.resize(signature[pos++]);
+
+        for (int j = 0; j < layout.visible.size(); j++) {
+            Visible_Layout &visible = layout.visible[j];
+
+            visible.size.x = signature[pos++];
+            visible.size.y = signature[pos++];
+            visible.size.z = signature[pos++];
+            visible.radius = signature[pos++];
+        }
+    }
+}
+
+// Weights of hidden cell z of the column bounds were found for onto visible layer vli, averaged over pool x pool squares when pool > 1.
+// weights: the visible layer's weights, laid out as an Image_Encoder's
+void get_receptive_field(
+    const Layer_Layout &layout,
+    int vli,
+    const unsigned char* weights,
+    const Field_Bounds &bounds,
+    int z,
+    int pool,
+    std::vector<unsigned char> &field,
+    std::vector<int> &sums,
+    Int3 &field_size
+) {
+    const Visible_Layout &vld = layout.visible[vli];
+
+    const aon::Int3 &hidden_size = layout.hidden_size;
+
+    int diam = bounds.diam;
+    int area = diam * diam;
 
-    int field_count = area * vld.size.z;
+    int pooled_diam = (diam + pool - 1) / pool;
 
-    field = std::vector<unsigned char>(field_count, 0);
+    if (pool == 1)
+        field.assign(area * vld.size.z, 0);
+    else
+        sums.assign(pooled_diam * pooled_diam * vld.size.z, 0);
 
-    for (int ix = iter_lower_bound.x; ix <= iter_upper_bound.x; ix++)
-        for (int iy = iter_lower_bound.y; iy <= iter_upper_bound.y; iy++) {
-            int visible_column_index = address2(aon::Int2(ix, iy), aon::Int2(vld.size.x, vld.size.y));
+    for (int ix = bounds.iter_lower_bound.x; ix <= bounds.iter_upper_bound.x; ix++)
+        for (int iy = bounds.iter_lower_bound.y; iy <= bounds.iter_upper_bound.y; iy++) {
+            aon::Int2 offset(ix - bounds.field_lower_bound.x, iy - bounds.field_lower_bound.y);
 
-            aon::Int2 offset(ix - field_lower_bound.x, iy - field_lower_bound.y);
+            int wi_start_partial = vld.size.z * (offset.y + diam * (offset.x + diam * bounds.hidden_column_index));
 
-            int wi_start_partial = vld.size.z * (offset.y + diam * (offset.x + diam * hidden_column_index));
+            if (pool == 1) {
+                for (int vc = 0; vc < vld.size.z; vc++) {
+                    int wi = z + hidden_size.z * (vc + wi_start_partial);
 
-            for (int vc = 0; vc < vld.size.z; vc++) {
-                int wi = pos.z + hidden_size.z * (vc + wi_start_partial);
+                    field[vc + vld.size.z * (offset.y + diam * offset.x)] = weights[wi];
+                }
+            }
+            else {
+                // Accumulate straight into the pooled weight this one falls in
+                int* cell_sums = &sums[vld.size.z * (offset.y / pool + pooled_diam * (offset.x / pool))];
 
-                field[vc + vld.size.z * (offset.y + diam * offset.x)] = vl.weights[wi];
+                for (int vc = 0; vc < vld.size.z; vc++)
+                    cell_sums[vc] += weights[z + hidden_size.z * (vc + wi_start_partial)];
             }
         }
 
-    field_size = Int3(diam, diam, vld.size.z);
+    if (pool > 1)
+        average_pooled_field(sums, diam, vld.size.z, pool, field);
+
+    field_size = Int3(pooled_diam, pooled_diam, vld.size.z);
 }
 
+// Same for weights laid out as an Encoder's
 void get_encoder_receptive_field(
-    const Hierarchy &h,
-    int l,
+    const Layer_Layout &layout,
     int vli,
-    const Int3 &pos,
+    const unsigned char* weights,
+    const Field_Bounds &bounds,
+    int z,
+    int pool,
     std::vector<unsigned char> &field,
+    std::vector<int> &sums,
     Int3 &field_size
 ) {
-    const aon::Encoder &enc = h.get_encoder(l);
+    const aon::Int3 &hidden_size = layout.hidden_size;
 
-    int num_visible_layers = enc.get_num_visible_layers();
+    const Visible_Layout &vld = layout.visible[vli];
 
-    const aon::Int3 &hidden_size = enc.get_hidden_size();
+    int diam = bounds.diam;
+    int area = diam * diam;
 
-    const aon::Encoder::Visible_Layer &vl = enc.get_visible_layer(vli);
-    const aon::Encoder::Visible_Layer_Desc &vld = enc.get_visible_layer_desc(vli);
+    int pooled_diam = (diam + pool - 1) / pool;
 
-    int diam = vld.radius * 2 + 1;
-    int area = diam * diam;
+    if (pool == 1)
+        field.assign(area * vld.size.z, 0);
+    else
+        sums.assign(pooled_diam * pooled_diam * vld.size.z, 0);
 
-    aon::Int2 column_pos(pos.x, pos.y);
+    for (int ix = bounds.iter_lower_bound.x; ix <= bounds.iter_upper_bound.x; ix++)
+        for (int iy = bounds.iter_lower_bound.y; iy <= bounds.iter_upper_bound.y; iy++) {
+            aon::Int2 offset(ix - bounds.field_lower_bound.x, iy - bounds.field_lower_bound.y);
 
-    int hidden_column_index = aon::address2(column_pos, aon::Int2(hidden_size.x, hidden_size.y));
-    int hidden_cells_start = hidden_size.z * hidden_column_index;
+            if (pool == 1) {
+                for (int vc = 0; vc < vld.size.z; vc++) {
+                    int wi = z + hidden_size.z * (offset.y + diam * (offset.x + diam * (vc + vld.size.z * bounds.hidden_column_index)));
 
-    // projection
-    aon::Float2 h_to_v = aon::Float2(static_cast<float>(vld.size.x) / static_cast<float>(hidden_size.x),
-            static_cast<float>(vld.size.y) / static_cast<float>(hidden_size.y));
+                    field[vc + vld.size.z * (offset.y + diam * offset.x)] = weights[wi];
+                }
+            }
+            else {
+                // Accumulate straight into the pooled weight this one falls in
+                int* cell_sums = &sums[vld.size.z * (offset.y / pool + pooled_diam * (offset.x / pool))];
 
-    aon::Int2 visible_center = project(column_pos, h_to_v);
+                for (int vc = 0; vc < vld.size.z; vc++)
+                    cell_sums[vc] += weights[z + hidden_size.z * (offset.y + diam * (offset.x + diam * (vc + vld.size.z * bounds.hidden_column_index)))];
+            }
+        }
 
-        // lower corner
-    aon::Int2 field_lower_bound(visible_center.x - vld.radius, visible_center.y - vld.radius);
+    if (pool > 1)
+        average_pooled_field(sums, diam, vld.size.z, pool, field);
 
-        // bounds of receptive field, clamped to input size
-    aon::Int2 iter_lower_bound(aon::max(0, field_lower_bound.x), aon::max(0, field_lower_bound.y));
-    aon::Int2 iter_upper_bound(aon::min(vld.size.x - 1, visible_center.x + vld.radius), aon::min(vld.size.y - 1, visible_center.y + vld.radius));
+    field_size = Int3(pooled_diam, pooled_diam, vld.size.z);
+}
 
-    int hidden_stride = vld.size.z * area;
+// Bounds of field vli of column column_pos of a layer
+void get_layer_field_bounds(
+    const Layer_Layout &layout,
+    int vli,
+    const Int2 &column_pos,
+    Field_Bounds &bounds
+) {
+    const Visible_Layout &vld = layout.visible[vli];
 
-    int field_count = area * vld.size.z;
+    get_field_bounds(layout.hidden_size, vld.size, vld.radius, column_pos, bounds);
+}
 
-    field = std::vector<unsigned char>(field_count, 0);
+// Field vli of cell z of the column bounds were found for, of a layer.
+// weights: the visible layer's weights
+void get_layer_field(
+    const Layer_Layout &layout,
+    int vli,
+    const unsigned char* weights,
+    const Field_Bounds &bounds,
+    int z,
+    int pool,
+    std::vector<unsigned char> &field,
+    std::vector<int> &sums,
+    Int3 &field_size
+) {
+    if (layout.image_encoder)
+        get_receptive_field(layout, vli, weights, bounds, z, pool, field, sums, field_size);
+    else
+        get_encoder_receptive_field(layout, vli, weights, bounds, z, pool, field, sums, field_size);
+}
 
-    for (int ix = iter_lower_bound.x; ix <= iter_upper_bound.x; ix++)
-        for (int iy = iter_lower_bound.y; iy <= iter_upper_bound.y; iy++) {
-            int visible_column_index = address2(aon::Int2(ix, iy), aon::Int2(vld.size.x, vld.size.y));
+// A field as get_layer_field extracts it unpooled (diam x diam x depth), averaged over pool x pool squares into field
+void get_pooled_field(
+    const std::vector<unsigned char> &raw,
+    int diam,
+    int depth,
+    int pool,
+    std::vector<unsigned char> &field,
+    std::vector<int> &sums,
+    Int3 &field_size
+) {
+    int pooled_diam = (diam + pool - 1) / pool;
 
-            aon::Int2 offset(ix - field_lower_bound.x, iy - field_lower_bound.y);
+    field_size = Int3(pooled_diam, pooled_diam, depth);
 
-            for (int vc = 0; vc < vld.size.z; vc++) {
-                int wi = pos.z + hidden_size.z * (offset.y + diam * (offset.x + diam * (vc + vld.size.z * hidden_column_index)));
+    // Copied even so, the field is quantized in place
+    if (pool == 1) {
+        field = raw;
 
-                field[vc + vld.size.z * (offset.y + diam * offset.x)] = vl.weights[wi];
-            }
+        return;
+    }
+
+    sums.assign(pooled_diam * pooled_diam * depth, 0);
+
+    // Weights outside the visible layer are 0 in raw, just as they add nothing when pooling the live weights
+    for (int ox = 0; ox < diam; ox++)
+        for (int oy = 0; oy < diam; oy++) {
+            int* cell_sums = &sums[depth * (oy / pool + pooled_diam * (ox / pool))];
+
+            const unsigned char* weights = &raw[depth * (oy + diam * ox)];
+
+            for (int vc = 0; vc < depth; vc++)
+                cell_sums[vc] += weights[vc];
         }
 
-    field_size = Int3(diam, diam, vld.size.z);
+    average_pooled_field(sums, diam, depth, pool, field);
 }
 
-void add(std::vector<unsigned char> &data, size_t size) {
-    data.resize(data.size() + size);
+void push_packed(Frame_Writer &writer, const int* values, size_t num_values, int bits) {
+    pack_bits(values, num_values, bits, writer.add(packed_size(num_values, bits)));
 }
 
-template<class T>
-void push(std::vector<unsigned char> &data, T value) {
-    size_t start = data.size();
+// Appends an encoding byte and its payload, LZ compressed when allowed and smaller
+void push_payload(
+    Frame_Writer &writer,
+    std::uint8_t encoding,
+    const unsigned char* payload,
+    size_t payload_size,
+    bool compress,
+    Encode_Scratch &scratch
+) {
+    if (compress) {
+        scratch.compressed.clear();
 
-    add(data, sizeof(T));
+        lz_compress(payload, payload_size, scratch.compressed);
 
-    *reinterpret_cast<T*>(&data[start]) = value;
-}
+        if (scratch.compressed.size() + 2 * sizeof(std::uint32_t) < payload_size) {
+            writer.push<std::uint8_t>(encoding | encoding_compressed);
+            writer.push<std::uint32_t>(static_cast<std::uint32_t>(payload_size));
+            writer.push<std::uint32_t>(static_cast<std::uint32_t>(scratch.compressed.size()));
 
-Vis_Adapter::Vis_Adapter(unsigned short port) {
-    listener.setBlocking(false);
+            writer.push_bytes(scratch.compressed.data(), scratch.compressed.size());
 
-    sf::Socket::Status status = listener.listen(port);
+            return;
+        }
+    }
+
+    writer.push<std::uint8_t>(encoding);
+
+    writer.push_bytes(payload, payload_size);
 }
 
-void Vis_Adapter::update(const Hierarchy &h, const std::vector<const Image_Encoder*> &encs) {
-    // Check for new connections
-    std::unique_ptr<sf::TcpSocket> socket = std::make_unique<sf::TcpSocket>();
+void push_csdr(
+    Frame_Writer &writer,
+    const Layer_State &state,
+    const Layer_State* base,
+    bool compress,
+    Encode_Scratch &scratch
+) {
+    int num_columns = state.cis.size();
 
-    if (listener.accept(*socket) == sf::Socket::Status::Done) {
-        socket->setBlocking(false);
+    int index_bits = bits_for(state.size.z);
+    int column_bits = bits_for(num_columns);
 
-        clients.push_back(std::move(socket));
+    // Without a matching previous state there is nothing to diff against
+    bool full = base == nullptr || base->cis.size() != num_columns;
 
-        std::cout << "Client connected from " << *clients.back()->getRemoteAddress() << std::endl;
+    scratch.changed_columns.clear();
+    scratch.changed_indices.clear();
+
+    if (!full) {
+        for (int i = 0; i < num_columns; i++) {
+            if (state.cis[i] != base->cis[i]) {
+                scratch.changed_columns.push_back(i);
+                scratch.changed_indices.push_back(state.cis[i]);
+            }
+        }
+
+        size_t num_changed = scratch.changed_columns.size();
+
+        size_t delta_size = max_varint_size + packed_size(num_changed, column_bits) + packed_size(num_changed, index_bits);
+
+        // Only worth it while the changed columns are smaller than the full layer
+        full = delta_size >= packed_size(num_columns, index_bits);
     }
 
-    // Send data to clients
-    for (int i = 0; i < clients.size();) {
-        std::vector<unsigned char> data(16);
+    // Pack straight into the frame unless the payload may still get compressed
+    Frame_Writer &payload = compress ? scratch.payload : writer;
 
-        size_t size;
-        size_t total_received = 0;
+    if (compress)
+        scratch.payload.clear();
+    else
+        writer.push<std::uint8_t>(full ? csdr_encoding_packed : csdr_encoding_delta);
 
-        bool disconnected = false;
+    if (full)
+        push_packed(payload, state.cis.data(), num_columns, index_bits);
+    else {
+        size_t num_changed = scratch.changed_columns.size();
 
-        if (clients[i]->receive(data.data(), data.size(), size) == sf::Socket::Status::Done) {
-            // --------------------------- Receive ----------------------------
+        payload.push_varint(static_cast<std::uint32_t>(num_changed));
 
-            total_received += size;
-            
-            while (total_received < data.size()) {
-                if (clients[i]->receive(&data[total_received], data.size() - total_received, size) == sf::Socket::Status::Done)
-                    total_received += size;
-                else
-                    sf::sleep(sf::seconds(0.001f));
-            }
+        push_packed(payload, scratch.changed_columns.data(), num_changed, column_bits);
+        push_packed(payload, scratch.changed_indices.data(), num_changed, index_bits);
+    }
+
+    if (compress)
+        push_payload(writer, full ? csdr_encoding_packed : csdr_encoding_delta, scratch.payload.get_data(), scratch.payload.get_size(), compress, scratch);
+}
+
+// Writes just the columns in rect, the viewer keeps the rest of the layer as it has it
+void push_csdr_roi(
+    Frame_Writer &writer,
+    const Layer_State &state,
+    const Column_Rect &rect,
+    bool compress,
+    Encode_Scratch &scratch
+) {
+    scratch.changed_indices.clear();
 
-            caret = *reinterpret_cast<Caret*>(data.data());
+    // Columns of a layer are stored column by column, so each column of the rectangle is one run
+    for (int x = rect.x; x < rect.x + rect.width; x++) {
+        const int* start = &state.cis[rect.y + x * state.size.y];
 
-            // Read away remaining data
-            while (clients[i]->receive(data.data(), data.size(), size) == sf::Socket::Status::Done);
-        }
+        scratch.changed_indices.insert(scratch.changed_indices.end(), start, start + rect.height);
+    }
+
+    Frame_Writer &payload = compress ? scratch.payload : writer;
+
+    if (compress)
+        scratch.payload.clear();
+    else
+        writer.push<std::uint8_t>(csdr_encoding_roi);
+
+    payload.push_varint(static_cast<std::uint32_t>(rect.x));
+    payload.push_varint(static_cast<std::uint32_t>(rect.y));
+    payload.push_varint(static_cast<std::uint32_t>(rect.width));
+    payload.push_varint(static_cast<std::uint32_t>(rect.height));
 
-        // ----------------------------- Send -----------------------------
+    push_packed(payload, scratch.changed_indices.data(), scratch.changed_indices.size(), bits_for(state.size.z));
 
-        data.clear();
+    if (compress)
+        push_payload(writer, csdr_encoding_roi, scratch.payload.get_data(), scratch.payload.get_size(), compress, scratch);
+}
 
-        push<std::uint16_t>(data, static_cast<std::uint16_t>(h.get_num_layers() + encs.size()));
-        push<std::uint16_t>(data, static_cast<std::uint16_t>(encs.size()));
+// Writes runs of changed weights (XORed with what the client holds), short unchanged gaps are folded into the runs
+void push_field_delta(
+    Frame_Writer &payload,
+    const std::vector<unsigned char> &field,
+    const std::vector<unsigned char> &base,
+    Encode_Scratch &scratch
+) {
+    int num_weights = field.size();
 
-        // Add encoder CSDRs
-        for (int j = 0; j < encs.size(); j++) {
-            Int3 s = encs[j]->get_hidden_size();
+    // Runs as (start, end) pairs, counted before they are written
+    scratch.field_runs.clear();
 
-            push<std::uint16_t>(data, static_cast<std::uint16_t>(s.x));
-            push<std::uint16_t>(data, static_cast<std::uint16_t>(s.y));
-            push<std::uint16_t>(data, static_cast<std::uint16_t>(s.z));
+    for (int i = 0; i < num_weights;) {
+        if (field[i] == base[i]) {
+            i++;
 
-            for (int k = 0; k < encs[j]->get_hidden_cis().size(); k++)
-                push<std::uint16_t>(data, static_cast<std::uint16_t>(encs[j]->get_hidden_cis()[k]));
+            continue;
         }
 
-        // Add layer SDRs
-        for (int j = 0; j < h.get_num_layers(); j++) {
-            Int3 s = h.get_encoder(j).get_hidden_size();
+        int end = i + 1;
 
-            push<std::uint16_t>(data, static_cast<std::uint16_t>(s.x));
-            push<std::uint16_t>(data, static_cast<std::uint16_t>(s.y));
-            push<std::uint16_t>(data, static_cast<std::uint16_t>(s.z));
-            
-            for (int k = 0; k < h.get_encoder(j).get_hidden_cis().size(); k++)
-                push<std::uint16_t>(data, static_cast<std::uint16_t>(h.get_encoder(j).get_hidden_cis()[k]));
+        // Gaps of up to 2 unchanged weights cost less inside a run than starting a new one
+        for (int j = end; j < num_weights && j < end + 3; j++) {
+            if (field[j] != base[j])
+                end = j + 1;
         }
 
-        int num_fields = 0;
-        int layer_index = 0;
+        scratch.field_runs.push_back(i);
+        scratch.field_runs.push_back(end);
+
+        i = end;
+    }
 
-        // If was initialized
-        if (caret.pos.x != -1) {
-            layer_index = caret.layer;
-            
-            if (layer_index < encs.size()) {
-                int enc_index = layer_index;
+    int num_runs = scratch.field_runs.size() / 2;
 
-                const Image_Encoder* enc = encs[enc_index];
+    payload.push_varint(static_cast<std::uint32_t>(num_runs));
 
-                bool in_bounds = caret.pos.x >= 0 && caret.pos.y >= 0 && caret.pos.z >= 0 &&
-                    caret.pos.x < enc->get_hidden_size().x && caret.pos.y < enc->get_hidden_size().y && caret.pos.z < enc->get_hidden_size().z;
+    int pos = 0;
 
-                num_fields = in_bounds ? enc->get_num_visible_layers() : 0;
-            }
-            else {
-                bool in_bounds = caret.pos.x >= 0 && caret.pos.y >= 0 && caret.pos.z >= 0 &&
-                    caret.pos.x < h.get_encoder(layer_index - encs.size()).get_hidden_size().x && caret.pos.y < h.get_encoder(layer_index - encs.size()).get_hidden_size().y && caret.pos.z < h.get_encoder(layer_index - encs.size()).get_hidden_size().z;
+    for (int r = 0; r < num_runs; r++) {
+        int start = scratch.field_runs[r * 2];
+        int end = scratch.field_runs[r * 2 + 1];
 
-                num_fields = in_bounds ? h.get_encoder(layer_index - encs.size()).get_num_visible_layers() : 0;
-            }
-        }
+        payload.push_varint(static_cast<std::uint32_t>(start - pos));
+        payload.push_varint(static_cast<std::uint32_t>(end - start));
+
+        unsigned char* changes = payload.add(end - start);
+
+        for (int i = start; i < end; i++)
+            changes[i - start] = field[i] ^ base[i];
+
+        pos = end;
+    }
+}
+
+// Writes a field's status and, unless the client already holds it, its size and weights: quantized (in place) to bits per weight
+// unless that is full precision, and as a delta against the last sent field when that is smaller
+void push_field(
+    Frame_Writer &writer,
+    std::vector<unsigned char> &field,
+    const Int3 &field_size,
+    int bits,
+    int pool,
+    Sent_Field &sent,
+    bool compress,
+    Encode_Scratch &scratch
+) {
+    if (bits < max_field_bits) {
+        int shift = max_field_bits - bits;
 
-        push<std::uint16_t>(data, static_cast<std::uint16_t>(num_fields));
+        for (int i = 0; i < field.size(); i++)
+            field[i] >>= shift;
+    }
 
-        if (layer_index < encs.size()) {
-            int enc_index = layer_index;
+    // Whatever the caret asked for when it was sent, a field of another bit depth or pooling holds other values
+    bool same_size = sent.bits == bits && sent.pool == pool &&
+        sent.size.x == field_size.x && sent.size.y == field_size.y && sent.size.z == field_size.z && sent.field.size() == field.size();
 
-            const Image_Encoder* enc = encs[enc_index];
+    if (same_size && sent.field == field) {
+        writer.push<std::uint8_t>(field_unchanged);
 
-            for (int j = 0; j < num_fields; j++) {
-                std::string field_name = "field " + std::to_string(j);
+        return;
+    }
 
-                size_t start = data.size();
+    writer.push<std::uint8_t>(field_changed);
 
-                add(data, field_name_size);
+    writer.push_varint(static_cast<std::uint32_t>(field_size.x));
+    writer.push_varint(static_cast<std::uint32_t>(field_size.y));
+    writer.push_varint(static_cast<std::uint32_t>(field_size.z));
 
-                for (int k = 0; k < field_name_size; k++)
-                    *reinterpret_cast<char*>(&data[start + k]) = (k < field_name.length() ? field_name[k] : '\0');
+    bool sent_delta = false;
 
-                std::vector<unsigned char> field;
-                Int3 field_size;
+    // The viewer holds quantized fields stretched back to full range, so only full precision ones can be diffed
+    if (same_size && bits >= max_field_bits) {
+        scratch.payload.clear();
 
-                get_receptive_field(*enc, j, Int3(caret.pos.x, caret.pos.y, caret.pos.z), field, field_size);
+        push_field_delta(scratch.payload, field, sent.field, scratch);
 
-                push<std::int32_t>(data, static_cast<std::int32_t>(field_size.x));
-                push<std::int32_t>(data, static_cast<std::int32_t>(field_size.y));
-                push<std::int32_t>(data, static_cast<std::int32_t>(field_size.z));
-            
-                for (int k = 0; k < field.size(); k++)
-                    push<unsigned char>(data, field[k]);
-            }
+        if (scratch.payload.get_size() < field.size()) {
+            push_payload(writer, field_encoding_xor_rle, scratch.payload.get_data(), scratch.payload.get_size(), compress, scratch);
+
+            sent_delta = true;
         }
+    }
+
+    if (!sent_delta) {
+        if (bits >= max_field_bits)
+            push_payload(writer, field_encoding_raw, field.data(), field.size(), compress, scratch);
         else {
-            for (int j = 0; j < num_fields; j++) {
-                std::string field_name = "field " + std::to_string(j);
+            scratch.payload.clear();
 
-                size_t start = data.size();
-                
-                add(data, field_name_size);
+            scratch.payload.push<std::uint8_t>(bits);
 
-                for (int k = 0; k < field_name_size; k++)
-                    *reinterpret_cast<char*>(&data[start + k]) = (k < field_name.length() ? field_name[k] : '\0');
+            pack_bits(field.data(), field.size(), bits, scratch.payload.add(packed_size(field.size(), bits)));
 
-                std::vector<unsigned char> field;
-                Int3 field_size;
+            push_payload(writer, field_encoding_quantized, scratch.payload.get_data(), scratch.payload.get_size(), compress, scratch);
+        }
+    }
 
-                get_encoder_receptive_field(h, layer_index - encs.size(), j, Int3(caret.pos.x, caret.pos.y, caret.pos.z), field, field_size);
+    sent.size = field_size;
+    sent.field = field;
+    sent.bits = bits;
+    sent.pool = pool;
+}
 
-                push<std::int32_t>(data, static_cast<std::int32_t>(field_size.x));
-                push<std::int32_t>(data, static_cast<std::int32_t>(field_size.y));
-                push<std::int32_t>(data, static_cast<std::int32_t>(field_size.z));
-            
-                for (int k = 0; k < field.size(); k++)
-                    push<unsigned char>(data, field[k]);
-            }
+bool is_subscribed(const Vis_Client &client, int l) {
+    return l >= client.subscribed.size() || client.subscribed[l] != 0;
+}
+
+// The columns of layer l the client shows, clamped to the layer, false if that is all of it
+bool get_roi(const Vis_Client &client, int l, const Int3 &size, Column_Rect &rect) {
+    if (l >= client.rois.size() || client.rois[l].width <= 0 || client.rois[l].height <= 0)
+        return false;
+
+    const Column_Rect &roi = client.rois[l];
+
+    rect.x = std::min(roi.x, size.x);
+    rect.y = std::min(roi.y, size.y);
+    rect.width = std::min(roi.width, size.x - rect.x);
+    rect.height = std::min(roi.height, size.y - rect.y);
+
+    return rect.width > 0 && rect.height > 0 && rect.width * rect.height < size.x * size.y;
+}
+
+bool same_caret(const Caret &a, const Caret &b) {
+    return a.layer == b.layer && a.field_bits == b.field_bits && a.field_pool == b.field_pool && a.pos == b.pos;
+}
+
+// Whether the client set a caret it has not been answered for yet
+bool caret_changed(const Vis_Client &client) {
+    return !same_caret(client.caret, client.sent_caret) || client.caret_id != client.sent_caret_id;
+}
+
+// Whether a state is due at max_rate per second (0 for every update) since_last the previous one, or will be within lookahead
+bool is_due(float max_rate, int frames_sent, sf::Time since_last, sf::Time lookahead) {
+    return max_rate <= 0.0f || frames_sent == 0 || since_last + lookahead >= sf::seconds(1.0f / max_rate);
+}
+
+// Number of receptive fields to send for a caret, 0 if it does not point at a valid cell
+int get_num_fields(
+    const std::vector<Layer_Layout> &layouts,
+    const Caret &caret
+) {
+    // If was initialized
+    if (caret.pos.x == -1 || caret.layer >= layouts.size())
+        return 0;
+
+    const Layer_Layout &layout = layouts[caret.layer];
+
+    bool in_bounds = caret.pos.x >= 0 && caret.pos.y >= 0 && caret.pos.z >= 0 &&
+        caret.pos.x < layout.hidden_size.x && caret.pos.y < layout.hidden_size.y && caret.pos.z < layout.hidden_size.z;
+
+    return in_bounds ? layout.visible.size() : 0;
+}
+
+// Upper bound on what push_fields writes, exact unless compression shrinks a field
+size_t get_fields_size_bound(
+    const std::vector<Layer_Layout> &layouts,
+    const Caret &caret
+) {
+    int num_fields = get_num_fields(layouts, caret);
+
+    size_t size = 2 * max_varint_size;
+
+    for (int j = 0; j < num_fields; j++) {
+        const Visible_Layout &vld = layouts[caret.layer].visible[j];
+
+        int diam = vld.radius * 2 + 1;
+
+        // Pooling and quantizing only ever shrink a field, bit depth byte aside
+        size += 3 * max_varint_size + 3 * sizeof(std::uint8_t) + static_cast<size_t>(diam) * diam * vld.size.z;
+    }
+
+    return size;
+}
+
+bool same_cell(const Caret &a, const Caret &b) {
+    return a.layer == b.layer && a.pos == b.pos;
+}
+
+// Cells of the same column share their field bounds
+bool same_column(const Caret &a, const Caret &b) {
+    return a.layer == b.layer && a.pos.x == b.pos.x && a.pos.y == b.pos.y;
+}
+
+// Whether the client's caret or one of its pins is on cell
+bool is_looked_at(const Vis_Client &client, const Caret &cell) {
+    if (same_cell(client.caret, cell))
+        return true;
+
+    for (int p = 0; p < client.pins.size(); p++) {
+        if (same_cell(client.pins[p], cell))
+            return true;
+    }
+
+    return false;
+}
+
+// Fields of a cell out of those the thread got copies of, nullptr if they have not arrived (yet)
+const Cell_Fields* find_cell_fields(
+    const std::vector<Cell_Fields> &cells,
+    const std::vector<Layer_Layout> &layouts,
+    const Caret &cell
+) {
+    for (int c = 0; c < cells.size(); c++) {
+        if (same_cell(cells[c].cell, cell))
+            return cells[c].visible.size() == get_num_fields(layouts, cell) ? &cells[c] : nullptr;
+    }
+
+    return nullptr;
+}
+
+// Fields of one cell, quantized and pooled as the caret says, diffed against sent_fields
+void push_cell_fields(
+    Frame_Writer &writer,
+    const Layer_Layout &layout,
+    const Cell_Fields &fields,
+    int bits,
+    int pool,
+    std::vector<Sent_Field> &sent_fields,
+    bool compress,
+    Encode_Scratch &scratch
+) {
+    int num_fields = fields.visible.size();
+
+    writer.push_varint(static_cast<std::uint32_t>(num_fields));
+
+    sent_fields.resize(num_fields);
+
+    for (int j = 0; j < num_fields; j++) {
+        const Visible_Layout &vld = layout.visible[j];
+
+        Int3 field_size;
+
+        get_pooled_field(fields.visible[j], vld.radius * 2 + 1, vld.size.z, pool, scratch.field, scratch.field_sums, field_size);
+
+        push_field(writer, scratch.field, field_size, bits, pool, sent_fields[j], compress, scratch);
+    }
+}
+
+// Receptive fields of the cell under a client's caret, which must have arrived if it points at a valid cell (see find_cell_fields).
+// sent_fields: the fields last sent for this caret, to diff against
+void push_fields(
+    Frame_Writer &writer,
+    const std::vector<Layer_Layout> &layouts,
+    const std::vector<Cell_Fields> &cells,
+    const Caret &caret,
+    std::vector<Sent_Field> &sent_fields,
+    bool compress,
+    Encode_Scratch &scratch
+) {
+    // Whatever the viewer asked for, within reason
+    int bits = std::min(max_field_bits, std::max(1, static_cast<int>(caret.field_bits)));
+    int pool = std::max(1, static_cast<int>(caret.field_pool));
+
+    writer.push_varint(caret.layer);
+
+    const Cell_Fields* fields = find_cell_fields(cells, layouts, caret);
+
+    if (get_num_fields(layouts, caret) == 0 || fields == nullptr) {
+        writer.push_varint(0);
+
+        return;
+    }
+
+    push_cell_fields(writer, layouts[caret.layer], *fields, bits, pool, sent_fields, compress, scratch);
+}
+
+// Fields of every pinned cell, likewise. bits and pool are the caret's, sent_pin_fields the fields last sent per pin to diff against
+void push_pinned_fields(
+    Frame_Writer &writer,
+    const std::vector<Layer_Layout> &layouts,
+    const std::vector<Cell_Fields> &cells,
+    const std::vector<Caret> &pins,
+    int bits,
+    int pool,
+    std::vector<std::vector<Sent_Field>> &sent_pin_fields,
+    bool compress,
+    Encode_Scratch &scratch
+) {
+    sent_pin_fields.resize(pins.size());
+
+    writer.push_varint(static_cast<std::uint32_t>(pins.size()));
+
+    for (int p = 0; p < pins.size(); p++) {
+        writer.push_varint(static_cast<std::uint32_t>(p));
+
+        const Cell_Fields* fields = find_cell_fields(cells, layouts, pins[p]);
+
+        if (get_num_fields(layouts, pins[p]) == 0 || fields == nullptr) {
+            writer.push_varint(0);
+
+            continue;
         }
 
-        size_t index = 0;
-        size_t total_sent = 0;
+        push_cell_fields(writer, layouts[pins[p].layer], *fields, bits, pool, sent_pin_fields[p], compress, scratch);
+    }
+}
 
-        while (total_sent < data.size()) {
-            sf::TcpSocket::Status status = clients[i]->send(&data[total_sent], data.size() - total_sent, size);
+void push_name(Frame_Writer &writer, const std::string &name) {
+    writer.push_varint(static_cast<std::uint32_t>(name.length()));
+    writer.push_bytes(name.data(), name.length());
+}
 
-            if (status == sf::Socket::Status::Disconnected) {
-                std::cout << "Client disconnected." << std::endl;
+// Everything the topology message describes, flattened, to cheaply notice when it changes
+void get_topology_signature(
+    const Hierarchy &h,
+    const std::vector<const Image_Encoder*> &encs,
+    std::vector<int> &signature
+) {
+    signature.clear();
 
-                clients.erase(clients.begin() + i);
+    signature.push_back(encs.size());
+    signature.push_back(h.get_num_layers());
 
-                disconnected = true;
+    for (int l = 0; l < encs.size(); l++) {
+        const Int3 &size = encs[l]->get_hidden_size();
 
-                break;
-            }
+        signature.push_back(size.x);
+        signature.push_back(size.y);
+        signature.push_back(size.z);
+        signature.push_back(encs[l]->get_num_visible_layers());
+
+        for (int j = 0; j < encs[l]->get_num_visible_layers(); j++) {
+            const Image_Encoder::Visible_Layer_Desc &vld = encs[l]->get_visible_layer_desc(j);
 
-            total_sent += size;
+            signature.push_back(vld.size.x);
+            signature.push_back(vld.size.y);
+            signature.push_back(vld.size.z);
+            signature.push_back(vld.radius);
+        }
+    }
+
+    for (int l = 0; l < h.get_num_layers(); l++) {
+        const Encoder &enc = h.get_encoder(l);
+
+        signature.push_back(enc.get_hidden_size().x);
+        signature.push_back(enc.get_hidden_size().y);
+        signature.push_back(enc.get_hidden_size().z);
+        signature.push_back(enc.get_num_visible_layers());
+
+        for (int j = 0; j < enc.get_num_visible_layers(); j++) {
+            const Encoder::Visible_Layer_Desc &vld = enc.get_visible_layer_desc(j);
+
+            signature.push_back(vld.size.x);
+            signature.push_back(vld.size.y);
+            signature.push_back(vld.size.z);
+            signature.push_back(vld.radius);
+        }
+    }
+}
+
+// Writes the topology message body out of a signature
+void push_topology(
+    Frame_Writer &writer,
+    std::uint32_t topology_id,
+    const std::vector<int> &signature
+) {
+    int pos = 0;
+
+    int num_encs = signature[pos++];
+    int num_layers = num_encs + signature[pos++];
+
+    writer.push<std::uint32_t>(topology_id);
+    writer.push_varint(static_cast<std::uint32_t>(num_layers));
+    writer.push_varint(static_cast<std::uint32_t>(num_encs));
+
+    for (int l = 0; l < num_layers; l++) {
+        push_name(writer, l < num_encs ? "Pre-encoder " + std::to_string(l) : "Layer " + std::to_string(l - num_encs));
+
+        for (int k = 0; k < 3; k++)
+            writer.push_varint(static_cast<std::uint32_t>(signature[pos++]));
+
+        int num_visible_layers = signature[pos++];
+
+        writer.push_varint(static_cast<std::uint32_t>(num_visible_layers));
+
+        for (int j = 0; j < num_visible_layers; j++) {
+            push_name(writer, "field " + std::to_string(j));
+
+            // Size and radius
+            for (int k = 0; k < 4; k++)
+                writer.push_varint(static_cast<std::uint32_t>(signature[pos++]));
         }
-        
-        if (!disconnected)
-            i++;
     }
 }
+
+Vis_Adapter::Vis_Adapter(unsigned short port, int keyframe_interval, int roi_summary_interval, bool shared_memory)
+:
+keyframe_interval(keyframe_interval),
+roi_summary_interval(roi_summary_interval),
+topology_id(0),
+num_encoded_layers(0),
+shared_memory(shared_memory),
+ring_name("/neovis_" + std::to_string(port)),
+ring_sequence(0),
+record_rate(0.0f),
+frames_recorded(0),
+recording_sequence(0),
+recorded_topology_id(0),
+back_snapshot(0),
+middle_snapshot(1),
+front_snapshot(2),
+weights_request(0),
+update_weights_request(0),
+stopping(false)
+{
+    listener.setBlocking(false);
+
+    sf::Socket::Status status = listener.listen(port);
+
+    udp_socket.setBlocking(false);
+
+    udp_socket.bind(sf::Socket::AnyPort);
+
+    network_thread = std::thread(&Vis_Adapter::network_thread_func, this);
+}
+
+Vis_Adapter::~Vis_Adapter() {
+    {
+        std::lock_guard<std::mutex> lock(snapshot_mutex);
+
+        stopping = true;
+    }
+
+    snapshot_ready.notify_one();
+
+    network_thread.join();
+}
+
+std::shared_ptr<Layer_State> Vis_Adapter::acquire_state() {
+    for (int i = 0; i < state_pool.size(); i++) {
+        // Only the pool still refers to it
+        if (state_pool[i].use_count() == 1)
+            return state_pool[i];
+    }
+
+    state_pool.push_back(std::make_shared<Layer_State>());
+
+    return state_pool.back();
+}
+
+void Vis_Adapter::fill_header(Frame_Writer &writer, std::uint8_t type, std::uint32_t sequence) {
+    Frame_Header header;
+    header.magic = frame_magic;
+    header.version = protocol_version;
+    header.type = type;
+    header.flags = 0;
+    header.sequence = sequence;
+    header.size = static_cast<std::uint32_t>(writer.get_size() - sizeof(Frame_Header));
+    header.timestamp = uptime.getElapsedTime().asMicroseconds();
+
+    std::memcpy(writer.get_data(), &header, sizeof(Frame_Header));
+}
+
+bool Vis_Adapter::send(Vis_Client &client, Frame_Writer &writer, std::uint8_t type) {
+    fill_header(writer, type, client.sequence++);
+
+    size_t total_sent = 0;
+
+    sf::Clock stalled;
+
+    while (total_sent < writer.get_size()) {
+        size_t sent = 0;
+
+        sf::TcpSocket::Status status = client.socket->send(&writer.get_data()[total_sent], writer.get_size() - total_sent, sent);
+
+        if (status == sf::Socket::Status::Disconnected || status == sf::Socket::Status::Error)
+            return false;
+
+        total_sent += sent;
+
+        if (sent > 0) {
+            stalled.restart();
+
+            continue;
+        }
+
+        // A viewer that stopped reading is dropped, rather than holding up every other client
+        if (stalled.getElapsedTime() >= send_timeout)
+            return false;
+
+        sf::sleep(sf::milliseconds(1));
+    }
+
+    return true;
+}
+
+bool Vis_Adapter::send_datagrams(Vis_Client &client, Frame_Writer &writer, std::uint8_t type) {
+    if (writer.get_size() > 0xffff * max_datagram_payload)
+        return false;
+
+    Datagram_Header header;
+    header.magic = frame_magic;
+    header.sequence = client.udp_sequence++;
+    header.num_chunks = static_cast<std::uint16_t>((writer.get_size() + max_datagram_payload - 1) / max_datagram_payload);
+
+    fill_header(writer, type, header.sequence);
+
+    datagram.resize(sizeof(Datagram_Header) + max_datagram_payload);
+
+    for (int c = 0; c < header.num_chunks; c++) {
+        size_t offset = c * max_datagram_payload;
+        size_t size = std::min(max_datagram_payload, writer.get_size() - offset);
+
+        header.chunk = c;
+
+        std::memcpy(datagram.data(), &header, sizeof(Datagram_Header));
+        std::memcpy(&datagram[sizeof(Datagram_Header)], &writer.get_data()[offset], size);
+
+        // A full send buffer loses the rest of the message, the viewer waits for the next one
+        if (udp_socket.send(datagram.data(), sizeof(Datagram_Header) + size, *client.udp_address, client.udp_port) != sf::Socket::Status::Done)
+            break;
+    }
+
+    return true;
+}
+
+bool Vis_Adapter::handle_commands(Vis_Client &client) {
+    size_t pos = 0;
+
+    while (client.received.size() - pos >= sizeof(Command_Header)) {
+        Command_Header header;
+
+        std::memcpy(&header, &client.received[pos], sizeof(Command_Header));
+
+        // Rest of it has yet to arrive
+        if (client.received.size() - pos - sizeof(Command_Header) < header.size)
+            break;
+
+        Frame_Reader body(&client.received[pos + sizeof(Command_Header)], header.size);
+
+        pos += sizeof(Command_Header) + header.size;
+
+        if (!client.greeted) {
+            Hello hello = body.read<Hello>();
+
+            if (header.type != command_hello || !body.is_valid() || hello.magic != frame_magic)
+                return false;
+
+            client.greeted = true;
+            client.codecs = hello.codecs;
+
+            if (hello.version != protocol_version)
+                std::cout << "Client speaks protocol version " << hello.version << ", expected " << protocol_version << "." << std::endl;
+
+            continue;
+        }
+
+        switch (header.type) {
+        case command_set_caret: {
+            Caret caret = body.read<Caret>();
+            std::uint32_t caret_id = body.read<std::uint32_t>();
+
+            if (body.is_valid()) {
+                client.caret = caret;
+                client.caret_id = caret_id;
+            }
+
+            break;
+        }
+        case command_subscribe: {
+            std::uint32_t num_layers = body.read_varint();
+
+            const unsigned char* bits = body.skip(packed_size(num_layers, 1));
+
+            if (bits != nullptr) {
+                client.subscribed.resize(num_layers);
+
+                unpack_bits(bits, num_layers, 1, client.subscribed.data());
+            }
+
+            break;
+        }
+        case command_set_max_rate: {
+            float max_rate = body.read<float>();
+
+            if (body.is_valid())
+                client.max_rate = std::max(0.0f, max_rate);
+
+            break;
+        }
+        case command_request_keyframe:
+            client.keyframe_requested = true;
+
+            break;
+        case command_set_roi: {
+            std::uint32_t layer = body.read_varint();
+
+            std::uint32_t values[4];
+
+            for (int k = 0; k < 4; k++)
+                values[k] = body.read_varint();
+
+            // No layer is anywhere near that large
+            const std::uint32_t max_roi_value = 1u << 24;
+
+            if (body.is_valid() && layer < max_roi_value) {
+                if (layer >= client.rois.size())
+                    client.rois.resize(layer + 1);
+
+                Column_Rect &roi = client.rois[layer];
+
+                roi.x = std::min(values[0], max_roi_value);
+                roi.y = std::min(values[1], max_roi_value);
+                roi.width = std::min(values[2], max_roi_value);
+                roi.height = std::min(values[3], max_roi_value);
+            }
+
+            break;
+        }
+        case command_set_pins: {
+            std::uint32_t pins_id = body.read<std::uint32_t>();
+            std::uint32_t num_pins = body.read_varint();
+
+            if (!body.is_valid() || num_pins > max_pins)
+                break;
+
+            std::vector<Caret> pins(num_pins);
+
+            for (int p = 0; p < num_pins; p++) {
+                pins[p].layer = std::min(body.read_varint(), 0xffffu);
+                pins[p].pos.x = std::min(body.read_varint(), static_cast<std::uint32_t>(std::numeric_limits<int>::max()));
+                pins[p].pos.y = std::min(body.read_varint(), static_cast<std::uint32_t>(std::numeric_limits<int>::max()));
+                pins[p].pos.z = std::min(body.read_varint(), static_cast<std::uint32_t>(std::numeric_limits<int>::max()));
+            }
+
+            if (body.is_valid()) {
+                client.pins = pins;
+                client.pins_id = pins_id;
+                client.pins_changed = true;
+            }
+
+            break;
+        }
+        case command_enable_udp: {
+            std::uint16_t port = body.read<std::uint16_t>();
+
+            if (body.is_valid()) {
+                client.udp_address = client.socket->getRemoteAddress();
+                client.udp_port = client.udp_address.has_value() ? port : 0;
+            }
+
+            break;
+        }
+        case command_enable_shm: {
+            std::uint8_t enable = body.read<std::uint8_t>();
+
+            // Without a ring the client keeps getting states over TCP
+            if (body.is_valid()) {
+                client.shm = enable != 0 && ring.is_open();
+
+                // Nothing it read from the ring is known to diff against once back on TCP
+                client.sent_states.clear();
+            }
+
+            break;
+        }
+        case command_request_weights: {
+            std::uint32_t layer = body.read_varint();
+
+            if (body.is_valid()) {
+                // Anything past the last layer cancels
+                client.weights_layer = std::min(layer, static_cast<std::uint32_t>(std::numeric_limits<int>::max()));
+                client.weights_cell = 0;
+            }
+
+            break;
+        }
+        }
+    }
+
+    client.received.erase(client.received.begin(), client.received.begin() + pos);
+
+    return true;
+}
+
+const Encoded_Layer &Vis_Adapter::get_encoded_layer(int l, const Layer_State* base, bool compress) {
+    for (int i = 0; i < num_encoded_layers; i++) {
+        if (encoded_layers[i].layer == l && encoded_layers[i].base == base && encoded_layers[i].compressed == compress)
+            return encoded_layers[i];
+    }
+
+    if (num_encoded_layers == encoded_layers.size())
+        encoded_layers.push_back(Encoded_Layer());
+
+    Encoded_Layer &encoded = encoded_layers[num_encoded_layers];
+
+    num_encoded_layers++;
+
+    encoded.layer = l;
+    encoded.base = base;
+    encoded.compressed = compress;
+
+    encoded.data.clear();
+
+    push_csdr(encoded.data, *states[l], base, compress, scratch);
+
+    return encoded;
+}
+
+void Vis_Adapter::write_shared_state(int num_layers) {
+    size_t frame_size = sizeof(Frame_Header) + sizeof(std::uint32_t);
+
+    for (int l = 0; l < num_layers; l++)
+        frame_size += scratch.shared_layers[l] ? get_encoded_layer(l, nullptr, false).data.get_size() : sizeof(std::uint8_t);
+
+    frame.clear(frame_size);
+
+    frame.add(sizeof(Frame_Header));
+
+    frame.push<std::uint32_t>(topology_id);
+
+    for (int l = 0; l < num_layers; l++) {
+        if (!scratch.shared_layers[l]) {
+            frame.push<std::uint8_t>(csdr_encoding_skipped);
+
+            continue;
+        }
+
+        const Encoded_Layer &encoded = get_encoded_layer(l, nullptr, false);
+
+        frame.push_bytes(encoded.data.get_data(), encoded.data.get_size());
+    }
+
+    fill_header(frame, message_state, ring_sequence++);
+
+    // Slots are sized from the topology, so this only happens if that was off. Readers follow to the larger ring
+    if (!ring.write(frame.get_data(), frame.get_size())) {
+        if (ring.create(ring_name, ring_slots, frame.get_size() * 2))
+            ring.write(frame.get_data(), frame.get_size());
+        else
+            std::cout << "Could not grow shared memory ring " << ring_name << "." << std::endl;
+    }
+}
+
+void Vis_Adapter::write_recorded_state(int num_layers) {
+    // Topology goes in whenever it changed, so the file can be read from the start on its own
+    if (recorded_topology_id != topology_id) {
+        fill_header(topology_frame, message_topology, recording_sequence++);
+
+        if (!recording.append(topology_frame.get_data(), topology_frame.get_size())) {
+            std::cout << "Recording is full, stopped recording." << std::endl;
+
+            if (!recording.close())
+                std::cout << "Could not trim the recording to what was written." << std::endl;
+
+            return;
+        }
+
+        recorded_topology_id = topology_id;
+
+        recorded_states.clear();
+    }
+
+    // Read from the start, deltas always have the state before them to apply to
+    bool keyframe = keyframe_interval <= 0 || frames_recorded % keyframe_interval == 0;
+
+    recorded_states.resize(num_layers);
+
+    size_t frame_size = sizeof(Frame_Header) + sizeof(std::uint32_t);
+
+    // serve() waits for a snapshot with every layer, skipping what is missing only keeps the file readable if that ever changes
+    for (int l = 0; l < num_layers; l++)
+        frame_size += states[l] == nullptr ? sizeof(std::uint8_t) : get_encoded_layer(l, keyframe ? nullptr : recorded_states[l].get(), false).data.get_size();
+
+    frame.clear(frame_size);
+
+    frame.add(sizeof(Frame_Header));
+
+    frame.push<std::uint32_t>(topology_id);
+
+    for (int l = 0; l < num_layers; l++) {
+        if (states[l] == nullptr) {
+            frame.push<std::uint8_t>(csdr_encoding_skipped);
+
+            continue;
+        }
+
+        const Encoded_Layer &encoded = get_encoded_layer(l, keyframe ? nullptr : recorded_states[l].get(), false);
+
+        frame.push_bytes(encoded.data.get_data(), encoded.data.get_size());
+
+        recorded_states[l] = states[l];
+    }
+
+    fill_header(frame, message_state, recording_sequence++);
+
+    if (!recording.append(frame.get_data(), frame.get_size())) {
+        std::cout << "Recording is full, stopped recording." << std::endl;
+
+        if (!recording.close())
+            std::cout << "Could not trim the recording to what was written." << std::endl;
+
+        return;
+    }
+
+    frames_recorded++;
+}
+
+bool Vis_Adapter::start_recording(const std::string &path, size_t capacity, float max_rate) {
+    std::lock_guard<std::mutex> lock(recording_mutex);
+
+    if (!recording.create(path, capacity))
+        return false;
+
+    record_rate = max_rate;
+    frames_recorded = 0;
+    recording_sequence = 0;
+    recorded_topology_id = 0;
+
+    recorded_states.clear();
+
+    return true;
+}
+
+bool Vis_Adapter::send_weights(Vis_Client &client) {
+    int l = client.weights_layer;
+
+    if (l >= layouts.size()) {
+        client.weights_layer = -1;
+
+        return true;
+    }
+
+    // Chunks go out once the next update copied the layer's weights, a download starting over waits for a fresh copy (see serve)
+    if (!has_weights[l] || (client.weights_cell == 0 && uptime.getElapsedTime() - weights_times[l] >= weights_copy_interval))
+        return true;
+
+    const Int3 &hidden_size = layouts[l].hidden_size;
+
+    int num_visible_layers = layouts[l].visible.size();
+
+    int num_cells = hidden_size.x * hidden_size.y * hidden_size.z;
+
+    int first_cell = client.weights_cell;
+    int cell = first_cell;
+
+    // Whole cells, at least one per chunk
+    scratch.payload.clear();
+
+    scratch.field_bounds.resize(num_visible_layers);
+
+    while (cell < num_cells && (cell == first_cell || scratch.payload.get_size() < weights_chunk_size)) {
+        int column_index = cell / hidden_size.z;
+
+        Int2 column_pos(column_index / hidden_size.y, column_index % hidden_size.y);
+
+        // Cells of a column are consecutive, so its bounds are found once for all of them
+        if (cell == first_cell || cell % hidden_size.z == 0) {
+            for (int j = 0; j < num_visible_layers; j++)
+                get_layer_field_bounds(layouts[l], j, column_pos, scratch.field_bounds[j]);
+        }
+
+        for (int j = 0; j < num_visible_layers; j++) {
+            Int3 field_size;
+
+            get_layer_field(layouts[l], j, layer_weights[l].visible[j].data(), scratch.field_bounds[j], cell % hidden_size.z, 1, scratch.field, scratch.field_sums, field_size);
+
+            scratch.payload.push_bytes(scratch.field.data(), scratch.field.size());
+        }
+
+        cell++;
+    }
+
+    weights_frame.clear(sizeof(Frame_Header) + sizeof(std::uint32_t) + 4 * max_varint_size + sizeof(std::uint8_t) + scratch.payload.get_size());
+
+    weights_frame.add(sizeof(Frame_Header));
+
+    weights_frame.push<std::uint32_t>(topology_id);
+    weights_frame.push_varint(static_cast<std::uint32_t>(l));
+    weights_frame.push_varint(static_cast<std::uint32_t>(first_cell));
+    weights_frame.push_varint(static_cast<std::uint32_t>(cell - first_cell));
+    weights_frame.push_varint(static_cast<std::uint32_t>(num_cells));
+
+    push_payload(weights_frame, field_encoding_raw, scratch.payload.get_data(), scratch.payload.get_size(), (client.codecs & codec_lz) != 0, scratch);
+
+    client.weights_cell = cell;
+
+    if (cell == num_cells)
+        client.weights_layer = -1;
+
+    return send(client, weights_frame, message_weights);
+}
+
+void Vis_Adapter::update(const Hierarchy &h, const std::vector<const Image_Encoder*> &encs) {
+    sf::Clock clock;
+
+    bool copy_weights = false;
+
+    // Whatever the thread last asked for, unless it holds the lock right now
+    if (snapshot_mutex.try_lock()) {
+        update_wanted_layers = wanted_layers;
+
+        // Weights are copied once per request, not every update
+        if (weights_request != update_weights_request) {
+            update_wanted_cells = wanted_cells;
+            update_wanted_weights = wanted_weights;
+            update_weights_request = weights_request;
+
+            copy_weights = true;
+        }
+
+        snapshot_mutex.unlock();
+    }
+
+    Snapshot &snapshot = snapshots[back_snapshot];
+
+    int num_layers = encs.size() + h.get_num_layers();
+
+    get_topology_signature(h, encs, snapshot.signature);
+
+    snapshot.states.resize(num_layers);
+    snapshot.captured.assign(num_layers, 0);
+
+    // Plain copies into buffers the network thread handed back, allocating only while layers grow
+    for (int l = 0; l < num_layers; l++) {
+        if (l >= update_wanted_layers.size() || !update_wanted_layers[l])
+            continue;
+
+        const Int_Buffer &cis = l < encs.size() ? encs[l]->get_hidden_cis() : h.get_encoder(l - encs.size()).get_hidden_cis();
+
+        if (snapshot.states[l] == nullptr)
+            snapshot.states[l] = std::make_shared<Layer_State>();
+
+        Layer_State &state = *snapshot.states[l];
+
+        state.size = l < encs.size() ? encs[l]->get_hidden_size() : h.get_encoder(l - encs.size()).get_hidden_size();
+        state.cis.resize(cis.size());
+
+        if (cis.size() > 0)
+            std::memcpy(state.cis.data(), &cis[0], cis.size() * sizeof(int));
+
+        snapshot.captured[l] = 1;
+    }
+
+    snapshot.weights.resize(num_layers);
+    snapshot.weights_captured.assign(num_layers, 0);
+
+    for (int l = 0; copy_weights && l < num_layers; l++) {
+        if (l >= update_wanted_weights.size() || !update_wanted_weights[l])
+            continue;
+
+        int num_visible_layers = l < encs.size() ? encs[l]->get_num_visible_layers() : h.get_encoder(l - encs.size()).get_num_visible_layers();
+
+        Weights_State &weights = snapshot.weights[l];
+
+        weights.visible.resize(num_visible_layers);
+
+        for (int j = 0; j < num_visible_layers; j++) {
+            const Byte_Buffer &visible_weights = l < encs.size() ? encs[l]->get_visible_layer(j).weights : h.get_encoder(l - encs.size()).get_visible_layer(j).weights;
+
+            weights.visible[j].resize(visible_weights.size());
+
+            if (visible_weights.size() > 0)
+                std::memcpy(weights.visible[j].data(), &visible_weights[0], visible_weights.size());
+        }
+
+        snapshot.weights_captured[l] = 1;
+    }
+
+    snapshot.num_cells = 0;
+
+    if (copy_weights && !update_wanted_cells.empty() && update_signature != snapshot.signature) {
+        update_signature = snapshot.signature;
+
+        get_layer_layouts(update_signature, update_layouts);
+    }
+
+    // Cell whose column the bounds in update_field_bounds are of, -1 for none yet
+    int bounds_cell = -1;
+
+    // Only the weights of the cells asked for, a field's worth per visible layer each, not the layers they are on.
+    // They come grouped by column, so bounds are found once per column for all the cells in it
+    for (int c = 0; copy_weights && c < update_wanted_cells.size(); c++) {
+        const Caret &cell = update_wanted_cells[c];
+
+        int num_fields = get_num_fields(update_layouts, cell);
+
+        if (num_fields == 0)
+            continue;
+
+        if (snapshot.num_cells == snapshot.cells.size())
+            snapshot.cells.push_back(Cell_Fields());
+
+        Cell_Fields &fields = snapshot.cells[snapshot.num_cells++];
+
+        fields.cell = cell;
+        fields.visible.resize(num_fields);
+
+        if (bounds_cell == -1 || !same_column(update_wanted_cells[bounds_cell], cell)) {
+            update_field_bounds.resize(num_fields);
+
+            for (int j = 0; j < num_fields; j++)
+                get_layer_field_bounds(update_layouts[cell.layer], j, Int2(cell.pos.x, cell.pos.y), update_field_bounds[j]);
+
+            bounds_cell = c;
+        }
+
+        for (int j = 0; j < num_fields; j++) {
+            const Byte_Buffer &visible_weights = cell.layer < encs.size() ? encs[cell.layer]->get_visible_layer(j).weights : h.get_encoder(cell.layer - encs.size()).get_visible_layer(j).weights;
+
+            Int3 field_size;
+
+            // Unpooled, so update_field_sums stays untouched
+            get_layer_field(update_layouts[cell.layer], j, &visible_weights[0], update_field_bounds[j], cell.pos.z, 1, fields.visible[j], update_field_sums, field_size);
+        }
+    }
+
+    // Hand it over, getting back the one the thread is done with, or the previous one if the thread did not take it in time
+    back_snapshot = middle_snapshot.exchange(back_snapshot | snapshot_fresh) & ~snapshot_fresh;
+
+    // Without the lock a wakeup may be missed, the thread then finds the snapshot at its next poll
+    snapshot_ready.notify_one();
+
+    if (snapshot_mutex.try_lock()) {
+        stats.snapshot_time = clock.getElapsedTime().asSeconds();
+
+        snapshot_mutex.unlock();
+    }
+}
+
+void Vis_Adapter::network_thread_func() {
+    std::unique_lock<std::mutex> lock(snapshot_mutex);
+
+    while (!stopping) {
+        // Clients are polled every so often even while no updates come
+        snapshot_ready.wait_for(lock, std::chrono::milliseconds(network_poll_interval), [this] { return stopping || (middle_snapshot.load() & snapshot_fresh) != 0; });
+
+        if (stopping)
+            break;
+
+        bool fresh = (middle_snapshot.load() & snapshot_fresh) != 0;
+
+        lock.unlock();
+
+        poll_clients();
+
+        if (fresh)
+            serve();
+
+        lock.lock();
+    }
+}
+
+void Vis_Adapter::poll_clients() {
+    // Check for new connections
+    if (pending_socket == nullptr)
+        pending_socket = std::make_unique<sf::TcpSocket>();
+
+    if (listener.accept(*pending_socket) == sf::Socket::Status::Done) {
+        pending_socket->setBlocking(false);
+
+        clients.push_back(Vis_Client());
+
+        clients.back().socket = std::move(pending_socket);
+
+        std::cout << "Client connected from " << *clients.back().socket->getRemoteAddress() << std::endl;
+    }
+
+    for (int i = 0; i < clients.size();) {
+        Vis_Client &client = clients[i];
+
+        unsigned char chunk[256];
+
+        size_t size;
+
+        sf::Socket::Status status;
+
+        while ((status = client.socket->receive(chunk, sizeof(chunk), size)) == sf::Socket::Status::Done)
+            client.received.insert(client.received.end(), chunk, chunk + size);
+
+        if (status == sf::Socket::Status::Disconnected || !handle_commands(client)) {
+            std::cout << "Client disconnected." << std::endl;
+
+            clients.erase(clients.begin() + i);
+
+            continue;
+        }
+
+        i++;
+    }
+}
+
+void Vis_Adapter::serve() {
+    // Take the newest snapshot, giving back the one served last
+    front_snapshot = middle_snapshot.exchange(front_snapshot) & ~snapshot_fresh;
+
+    Snapshot &snapshot = snapshots[front_snapshot];
+
+    int num_layers = snapshot.states.size();
+
+    // Weights of another topology are of no use
+    if (snapshot.signature != scratch.signature) {
+        has_weights.assign(num_layers, 0);
+
+        cell_fields.clear();
+
+        get_layer_layouts(snapshot.signature, layouts);
+    }
+
+    scratch.signature.swap(snapshot.signature);
+
+    // Captured buffers move on to clients, the snapshot gets others to copy into next time
+    states.resize(num_layers);
+
+    for (int l = 0; l < num_layers; l++) {
+        states[l].reset();
+
+        if (!snapshot.captured[l])
+            continue;
+
+        states[l] = snapshot.states[l];
+
+        snapshot.states[l] = acquire_state();
+    }
+
+    sf::Time now = uptime.getElapsedTime();
+
+    layer_weights.resize(num_layers);
+    has_weights.resize(num_layers, 0);
+    weights_times.resize(num_layers);
+
+    for (int l = 0; l < num_layers; l++) {
+        if (!snapshot.weights_captured[l])
+            continue;
+
+        layer_weights[l].visible.swap(snapshot.weights[l].visible);
+
+        has_weights[l] = 1;
+        weights_times[l] = now;
+    }
+
+    // Fresh fields replace those of the same cell, the others are kept while a caret or pin is still on them
+    for (int c = 0; c < snapshot.num_cells; c++) {
+        Cell_Fields &fields = snapshot.cells[c];
+
+        int k = 0;
+
+        while (k < cell_fields.size() && !same_cell(cell_fields[k].cell, fields.cell))
+            k++;
+
+        if (k == cell_fields.size()) {
+            cell_fields.push_back(Cell_Fields());
+
+            cell_fields[k].cell = fields.cell;
+        }
+
+        cell_fields[k].visible.swap(fields.visible);
+    }
+
+    for (int k = 0; k < cell_fields.size();) {
+        bool looked_at = false;
+
+        for (int i = 0; i < clients.size() && !looked_at; i++)
+            looked_at = is_looked_at(clients[i], cell_fields[k].cell);
+
+        if (looked_at)
+            k++;
+        else
+            cell_fields.erase(cell_fields.begin() + k);
+    }
+
+    // Snapshots likely keep coming at the pace they did
+    sf::Time lookahead = now - last_serve_time;
+
+    last_serve_time = now;
+
+    // Whether every layer is there, those not captured were not wanted by anyone due
+    bool all_captured = true;
+
+    for (int l = 0; l < num_layers; l++)
+        all_captured = all_captured && states[l] != nullptr;
+
+    // Too soon for another state means whatever is current once the client's interval passed.
+    // A state missing a layer the client shows waits for the next snapshot, which has it
+    for (int i = 0; i < clients.size(); i++) {
+        Vis_Client &client = clients[i];
+
+        client.state_due = is_due(client.max_rate, client.frames_sent, now - client.last_send_time, sf::Time::Zero);
+
+        for (int l = 0; l < num_layers && client.state_due; l++)
+            client.state_due = !is_subscribed(client, l) || states[l] != nullptr;
+    }
+
+    bool recording_due;
+    bool recording_due_soon;
+
+    {
+        std::lock_guard<std::mutex> lock(recording_mutex);
+
+        recording_due = recording.is_open() && all_captured && is_due(record_rate, frames_recorded, now - last_record_time, sf::Time::Zero);
+        recording_due_soon = recording.is_open() && is_due(record_rate, frames_recorded, now - last_record_time, lookahead);
+    }
+
+    // Ask for the layers of those due for a state by the next snapshot, for fresh fields of the cells under their carets and pins,
+    // and for the weights of layers they start downloading
+    {
+        std::lock_guard<std::mutex> lock(snapshot_mutex);
+
+        wanted_layers.assign(num_layers, recording_due_soon);
+        wanted_cells.clear();
+        wanted_weights.assign(num_layers, 0);
+
+        bool any_weights = false;
+
+        for (int i = 0; i < clients.size(); i++) {
+            const Vis_Client &client = clients[i];
+
+            bool due_soon = client.state_due || is_due(client.max_rate, client.frames_sent, now - client.last_send_time, lookahead);
+
+            if (due_soon) {
+                for (int l = 0; l < num_layers; l++)
+                    wanted_layers[l] = wanted_layers[l] || is_subscribed(client, l);
+            }
+
+            if (!due_soon && !caret_changed(client) && !client.pins_changed)
+                continue;
+
+            for (int p = -1; p < static_cast<int>(client.pins.size()); p++) {
+                const Caret &cell = p == -1 ? client.caret : client.pins[p];
+
+                if (get_num_fields(layouts, cell) == 0)
+                    continue;
+
+                bool wanted = false;
+
+                // Goes right after the cells already asked for in its column, so update() finds the column's bounds once
+                int insert_at = wanted_cells.size();
+
+                for (int c = 0; c < wanted_cells.size() && !wanted; c++) {
+                    wanted = same_cell(wanted_cells[c], cell);
+
+                    if (same_column(wanted_cells[c], cell))
+                        insert_at = c + 1;
+                }
+
+                if (!wanted)
+                    wanted_cells.insert(wanted_cells.begin() + insert_at, cell);
+            }
+
+            // Whole layers only for downloads, copied once as one starts (see send_weights)
+            int l = client.weights_layer;
+
+            if (l >= 0 && l < num_layers && (!has_weights[l] || (client.weights_cell == 0 && now - weights_times[l] >= weights_copy_interval)))
+                wanted_weights[l] = 1;
+        }
+
+        any_weights = !wanted_cells.empty();
+
+        for (int l = 0; l < num_layers; l++)
+            any_weights = any_weights || wanted_weights[l];
+
+        if (any_weights)
+            weights_request++;
+    }
+
+    int num_clients = clients.size();
+
+    // The ring is there before any viewer looks for it, and grows with the layers (as full packed layers, see push_csdr)
+    if (shared_memory) {
+        size_t state_size_bound = sizeof(Frame_Header) + sizeof(std::uint32_t);
+
+        for (int l = 0; l < num_layers; l++) {
+            const Int3 &size = layouts[l].hidden_size;
+
+            state_size_bound += sizeof(std::uint8_t) + packed_size(size.x * size.y, bits_for(size.z));
+        }
+
+        if (ring.get_slot_size() < state_size_bound && !ring.create(ring_name, ring_slots, state_size_bound * 2)) {
+            std::cout << "Could not create shared memory ring " << ring_name << ", states only go over TCP." << std::endl;
+
+            shared_memory = false;
+        }
+    }
+
+    if (recording_due)
+        last_record_time = now;
+
+    // Snapshots between the states clients are due cost nothing more
+    bool any_due = recording_due;
+
+    for (int i = 0; i < clients.size(); i++)
+        any_due = any_due || clients[i].state_due || caret_changed(clients[i]) || clients[i].pins_changed;
+
+    if (!any_due)
+        return;
+
+    sf::Clock clock;
+
+    // Topology only goes out again when it changed
+    if (topology_id == 0 || scratch.signature != topology_signature) {
+        topology_id++;
+
+        topology_signature = scratch.signature;
+
+        topology_frame.clear();
+        topology_frame.add(sizeof(Frame_Header));
+
+        push_topology(topology_frame, topology_id, topology_signature);
+    }
+
+    num_encoded_layers = 0;
+
+    float encode_time = 0.0f;
+
+    // Whether some reader of the ring is due a state, and which layers it wants
+    bool shared_due = false;
+
+    scratch.shared_layers.assign(num_layers, 0);
+
+    // Send data to clients
+    for (int i = 0; i < clients.size();) {
+        Vis_Client &client = clients[i];
+
+        bool state_due = client.state_due;
+
+        // A new caret is answered right away regardless
+        bool new_caret = caret_changed(client);
+
+        if (!state_due && !new_caret && !client.pins_changed) {
+            i++;
+
+            continue;
+        }
+
+        bool keyframe = state_due && (client.keyframe_requested || keyframe_interval <= 0 || client.frames_sent % keyframe_interval == 0);
+
+        if (state_due)
+            client.keyframe_requested = false;
+
+        if (client.sent_topology_id != topology_id) {
+            if (!send(client, topology_frame, message_topology)) {
+                std::cout << "Client disconnected." << std::endl;
+
+                clients.erase(clients.begin() + i);
+
+                continue;
+            }
+
+            client.sent_topology_id = topology_id;
+
+            // The viewer drops its fields along with the old topology
+            client.sent_fields.clear();
+            client.sent_pin_fields.clear();
+            client.sent_states.clear();
+
+            // Weights being streamed start over against the new topology
+            client.weights_cell = 0;
+
+            // Start over from full layers against the new topology
+            keyframe = state_due;
+        }
+
+        bool compress = (client.codecs & codec_lz) != 0;
+
+        // Pinned fields are quantized and pooled like the caret's
+        bool field_format_changed = client.caret.field_bits != client.sent_caret.field_bits || client.caret.field_pool != client.sent_caret.field_pool;
+
+        // Fields wait for copies of their cells' weights, asked for above and copied by the next update
+        bool fields_ready = get_num_fields(layouts, client.caret) == 0 || find_cell_fields(cell_fields, layouts, client.caret) != nullptr;
+        bool pins_ready = true;
+
+        for (int p = 0; p < client.pins.size(); p++)
+            pins_ready = pins_ready && (get_num_fields(layouts, client.pins[p]) == 0 || find_cell_fields(cell_fields, layouts, client.pins[p]) != nullptr);
+
+        if (fields_ready) {
+            // Fields go first so the answer to a click does not wait behind every layer.
+            // Sent fields only carry over while the caret stays put, and keyframes resend them in full
+            if (keyframe || new_caret)
+                client.sent_fields.clear();
+
+            client.sent_caret = client.caret;
+            client.sent_caret_id = client.caret_id;
+
+            fields_frame.clear(sizeof(Frame_Header) + 2 * sizeof(std::uint32_t) + get_fields_size_bound(layouts, client.caret));
+
+            fields_frame.add(sizeof(Frame_Header));
+
+            fields_frame.push<std::uint32_t>(topology_id);
+            fields_frame.push<std::uint32_t>(client.caret_id);
+
+            push_fields(fields_frame, layouts, cell_fields, client.caret, client.sent_fields, compress, scratch);
+
+            if (!send(client, fields_frame, message_fields)) {
+                std::cout << "Client disconnected." << std::endl;
+
+                clients.erase(clients.begin() + i);
+
+                continue;
+            }
+        }
+
+        // Pinned fields follow the same rules, resent in full when the pins change
+        if ((!client.pins.empty() || client.pins_changed) && pins_ready) {
+            if (keyframe || client.pins_changed || field_format_changed)
+                client.sent_pin_fields.clear();
+
+            client.pins_changed = false;
+
+            size_t size_bound = sizeof(Frame_Header) + 2 * sizeof(std::uint32_t) + max_varint_size;
+
+            for (int p = 0; p < client.pins.size(); p++)
+                size_bound += max_varint_size + get_fields_size_bound(layouts, client.pins[p]);
+
+            fields_frame.clear(size_bound);
+
+            fields_frame.add(sizeof(Frame_Header));
+
+            fields_frame.push<std::uint32_t>(topology_id);
+            fields_frame.push<std::uint32_t>(client.pins_id);
+
+            int bits = std::min(max_field_bits, std::max(1, static_cast<int>(client.caret.field_bits)));
+            int pool = std::max(1, static_cast<int>(client.caret.field_pool));
+
+            push_pinned_fields(fields_frame, layouts, cell_fields, client.pins, bits, pool, client.sent_pin_fields, compress, scratch);
+
+            if (!send(client, fields_frame, message_pinned_fields)) {
+                std::cout << "Client disconnected." << std::endl;
+
+                clients.erase(clients.begin() + i);
+
+                continue;
+            }
+        }
+
+        if (!state_due) {
+            i++;
+
+            continue;
+        }
+
+        if (client.shm && ring.is_open()) {
+            // Readers of the ring all share the one state written below
+            shared_due = true;
+
+            for (int l = 0; l < num_layers; l++)
+                scratch.shared_layers[l] = scratch.shared_layers[l] || (is_subscribed(client, l) && states[l] != nullptr);
+        }
+        else {
+            client.sent_states.resize(num_layers);
+
+            // Encode (or look up) this client's layers first so the frame size is known before writing it
+            size_t frame_size = sizeof(Frame_Header) + sizeof(std::uint32_t);
+
+            sf::Time encode_start = clock.getElapsedTime();
+
+            // Datagrams get lost, so every one carries full layers
+            bool udp = client.udp_port != 0;
+            bool full = keyframe || udp;
+
+            // Layers the client shows part of get only that part, except every so often when the changes to the rest go too
+            bool summary = full || roi_summary_interval <= 0 || client.frames_sent % roi_summary_interval == 0;
+
+            scratch.rois.resize(num_layers);
+
+            for (int l = 0; l < num_layers; l++) {
+                scratch.rois[l] = Column_Rect();
+
+                // States wait for the layers the client shows (see serve), so only the others are missing
+                if (!is_subscribed(client, l) || states[l] == nullptr) {
+                    frame_size += sizeof(std::uint8_t);
+
+                    continue;
+                }
+
+                const Layer_State* base = full ? nullptr : client.sent_states[l].get();
+
+                // A rectangle can only patch a layer the viewer holds in full
+                if (!summary && base != nullptr && base->cis.size() == states[l]->cis.size() && get_roi(client, l, states[l]->size, scratch.rois[l])) {
+                    frame_size += sizeof(std::uint8_t) + 4 * max_varint_size + packed_size(scratch.rois[l].width * scratch.rois[l].height, bits_for(states[l]->size.z));
+
+                    continue;
+                }
+
+                frame_size += get_encoded_layer(l, base, compress).data.get_size();
+            }
+
+            // Encoding is only paid by the first client that needs each variant
+            encode_time += (clock.getElapsedTime() - encode_start).asSeconds();
+
+            frame.clear(frame_size);
+
+            // Header is filled in once the body size is known
+            frame.add(sizeof(Frame_Header));
+
+            frame.push<std::uint32_t>(topology_id);
+
+            for (int l = 0; l < num_layers; l++) {
+                // Unsubscribed layers keep their last sent state, so deltas pick up from there once subscribed again
+                if (!is_subscribed(client, l) || states[l] == nullptr) {
+                    frame.push<std::uint8_t>(csdr_encoding_skipped);
+
+                    continue;
+                }
+
+                const Layer_State* base = full ? nullptr : client.sent_states[l].get();
+
+                const Column_Rect &rect = scratch.rois[l];
+
+                if (rect.width > 0) {
+                    push_csdr_roi(frame, *states[l], rect, compress, scratch);
+
+                    // Track what the viewer now holds, its last state with the rectangle brought up to date,
+                    // so the next summary is an exact delta. Copying the layer costs far less than sending it
+                    std::shared_ptr<Layer_State> held = acquire_state();
+
+                    held->size = base->size;
+                    held->cis = base->cis;
+
+                    for (int x = rect.x; x < rect.x + rect.width; x++) {
+                        int start = rect.y + x * held->size.y;
+
+                        std::memcpy(&held->cis[start], &states[l]->cis[start], rect.height * sizeof(int));
+                    }
+
+                    client.sent_states[l] = held;
+
+                    continue;
+                }
+
+                const Encoded_Layer &encoded = get_encoded_layer(l, base, compress);
+
+                frame.push_bytes(encoded.data.get_data(), encoded.data.get_size());
+
+                // Whether a datagram arrived is never known, so nothing is there to diff against once back on TCP
+                client.sent_states[l] = udp ? nullptr : states[l];
+            }
+
+            // Messages too large to split go over TCP after all
+            if (!(udp && send_datagrams(client, frame, message_state)) && !send(client, frame, message_state)) {
+                std::cout << "Client disconnected." << std::endl;
+
+                clients.erase(clients.begin() + i);
+
+                continue;
+            }
+        }
+
+        client.frames_sent++;
+        client.last_send_time = now;
+
+        // Weights trickle out a chunk behind each state, so the states themselves are never held back for long
+        if (client.weights_layer >= 0 && !send_weights(client)) {
+            std::cout << "Client disconnected." << std::endl;
+
+            clients.erase(clients.begin() + i);
+
+            continue;
+        }
+
+        i++;
+    }
+
+    if (shared_due) {
+        sf::Time encode_start = clock.getElapsedTime();
+
+        write_shared_state(num_layers);
+
+        encode_time += (clock.getElapsedTime() - encode_start).asSeconds();
+    }
+
+    if (recording_due) {
+        sf::Time encode_start = clock.getElapsedTime();
+
+        // Only the writing holds it, so stop_recording never waits on the clients. It may have stopped since
+        std::lock_guard<std::mutex> lock(recording_mutex);
+
+        if (recording.is_open())
+            write_recorded_state(num_layers);
+
+        encode_time += (clock.getElapsedTime() - encode_start).asSeconds();
+    }
+
+    float total_time = clock.getElapsedTime().asSeconds();
+
+    std::lock_guard<std::mutex> lock(snapshot_mutex);
+
+    stats.num_clients = num_clients;
+    stats.shared_time = encode_time;
+
+    // Recording alone may have been all there was to do
+    stats.client_time = num_clients > 0 ? (total_time - encode_time) / num_clients : 0.0f;
+}
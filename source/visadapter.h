@@ -12,31 +12,439 @@
 #include <SFML/Network.hpp>
 #include <aogmaneo/hierarchy.h>
 #include <aogmaneo/image_encoder.h>
+#include "protocol.h"
+#include "shm_ring.h"
+#include "tail_file.h"
 #include <vector>
 #include <memory>
+#include <optional>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 
 using namespace aon;
 
+// Body of command_set_caret
 struct Caret {
     std::uint16_t layer;
+    std::uint8_t field_bits;
+    std::uint8_t field_pool;
     sf::Vector3i pos;
 
     Caret()
     : layer(0),
+    field_bits(max_field_bits),
+    field_pool(1),
     pos(-1, -1, -1)
     {}
 };
 
+static_assert(sizeof(Caret) == 16, "Caret must stay a 16-byte record");
+
+// Rectangle of columns a viewer is looking at (see command_set_roi), width or height 0 for the whole layer
+struct Column_Rect {
+    int x, y;
+    int width, height;
+
+    Column_Rect()
+    : x(0), y(0),
+    width(0), height(0)
+    {}
+};
+
+// Where a hidden column's receptive field onto a visible layer lies, the same for every cell of the column
+struct Field_Bounds {
+    int diam;
+    int hidden_column_index;
+
+    Int2 field_lower_bound;
+    Int2 iter_lower_bound;
+    Int2 iter_upper_bound;
+};
+
+// Sizes of one visible layer, as the topology signature has them
+struct Visible_Layout {
+    Int3 size;
+    int radius;
+};
+
+// Sizes of one layer (pre-encoders first), so the network thread never reads the hierarchy
+struct Layer_Layout {
+    Int3 hidden_size;
+    bool image_encoder; // Pre-encoders lay their weights out differently
+    std::vector<Visible_Layout> visible;
+};
+
+// Column indices of one layer as of one update, shared by every client that was sent them
+struct Layer_State {
+    Int3 size;
+    std::vector<int> cis;
+};
+
+// Weights of one layer's visible layers as of one update, weights downloads are extracted from these instead of the live encoder
+struct Weights_State {
+    std::vector<std::vector<unsigned char>> visible;
+};
+
+// Unpooled receptive fields of one hidden cell as of one update, per visible layer. Caret and pinned fields come from these
+struct Cell_Fields {
+    Caret cell; // Only layer and pos
+    std::vector<std::vector<unsigned char>> visible;
+};
+
+// What update() hands the network thread: hidden states (and weights asked for) as of that update, copied in bulk
+struct Snapshot {
+    std::vector<int> signature; // See get_topology_signature
+
+    // Per layer, only those captured are current
+    std::vector<std::shared_ptr<Layer_State>> states;
+    std::vector<unsigned char> captured;
+
+    std::vector<Weights_State> weights;
+    std::vector<unsigned char> weights_captured;
+
+    // The first num_cells are the fields of the cells asked for, kept past that so their buffers get reused
+    std::vector<Cell_Fields> cells;
+    int num_cells;
+
+    Snapshot()
+    :
+    num_cells(0)
+    {}
+};
+
+// A layer's serialized CSDR (encoding and payload), built once per update and copied to every client that needs it
+struct Encoded_Layer {
+    int layer;
+    const Layer_State* base; // State the delta is against, nullptr for a full layer
+    bool compressed;
+
+    Frame_Writer data;
+};
+
+// Buffers reused from one encode to the next
+struct Encode_Scratch {
+    std::vector<int> changed_columns;
+    std::vector<int> changed_indices;
+
+    Frame_Writer payload;
+
+    std::vector<unsigned char> compressed;
+
+    std::vector<unsigned char> field;
+    std::vector<int> field_sums; // Per pooled weight, while pooling
+    std::vector<int> field_runs; // Start and end of each run of a field delta
+
+    std::vector<Field_Bounds> field_bounds; // Per visible layer of one column
+
+    std::vector<int> signature;
+
+    std::vector<Column_Rect> rois; // Per layer of the client being sent to, empty where the layer goes whole
+
+    std::vector<unsigned char> shared_layers; // Per layer whether a reader of the shared memory ring subscribed to it
+};
+
+// A receptive field as a client last received it (quantized values if quantized)
+struct Sent_Field {
+    Int3 size;
+    std::vector<unsigned char> field;
+
+    // Bit depth and pooling it went out with, only a field sent alike can be diffed against
+    int bits;
+    int pool;
+
+    Sent_Field()
+    :
+    bits(0),
+    pool(0)
+    {}
+};
+
+struct Vis_Client {
+    std::unique_ptr<sf::TcpSocket> socket;
+
+    Caret caret;
+
+    // Layer states this client last received, to diff against
+    std::vector<std::shared_ptr<const Layer_State>> sent_states;
+
+    int frames_sent;
+
+    // Of the next message to the client
+    std::uint32_t sequence;
+
+    // Where states go as datagrams (see command_enable_udp), port 0 while they go over TCP, and the sequence of the next one
+    std::optional<sf::IpAddress> udp_address;
+    unsigned short udp_port;
+    std::uint32_t udp_sequence;
+
+    // Reads states from the shared memory ring (see command_enable_shm)
+    bool shm;
+
+    std::uint32_t sent_topology_id;
+
+    // Caret the fields were last sent for, and those fields, to diff against
+    Caret sent_caret;
+    std::vector<Sent_Field> sent_fields;
+
+    // Given by the viewer with every caret, echoed back with the fields answering it
+    std::uint32_t caret_id;
+    std::uint32_t sent_caret_id;
+
+    // Pinned cells (only their layer and position are used), their id, and per pin the fields last sent for it
+    std::vector<Caret> pins;
+    std::uint32_t pins_id;
+    bool pins_changed;
+    std::vector<std::vector<Sent_Field>> sent_pin_fields;
+
+    // Set once the client's Hello arrived
+    bool greeted;
+
+    std::uint16_t codecs;
+
+    // Received bytes not yet making up a whole command
+    std::vector<unsigned char> received;
+
+    // Per layer whether to send it, layers past the end are sent
+    std::vector<unsigned char> subscribed;
+
+    // Per layer the columns the viewer shows, layers past the end are shown whole
+    std::vector<Column_Rect> rois;
+
+    // Layer whose weights are being streamed (-1 for none), and the cell the next chunk starts at
+    int weights_layer;
+    int weights_cell;
+
+    float max_rate; // States per second, 0 for no limit
+    sf::Time last_send_time;
+
+    // Whether the client gets a state this update
+    bool state_due;
+
+    bool keyframe_requested;
+
+    Vis_Client()
+    :
+    frames_sent(0),
+    sequence(0),
+    udp_port(0),
+    udp_sequence(0),
+    shm(false),
+    sent_topology_id(0),
+    caret_id(0),
+    sent_caret_id(0),
+    pins_id(0),
+    pins_changed(false),
+    greeted(false),
+    codecs(0),
+    weights_layer(-1),
+    weights_cell(0),
+    max_rate(0.0f),
+    state_due(false),
+    keyframe_requested(false)
+    {}
+};
+
+// Serialization cost of the last snapshot the network thread sent anything for, split into the part shared by all clients and the part each client adds
+struct Vis_Stats {
+    int num_clients;
+
+    float snapshot_time; // Seconds the last update took, all the caller pays
+    float shared_time; // Seconds spent encoding layers, paid once however many clients there are
+    float client_time; // Average seconds per client for everything else (fields, assembly, sending)
+
+    Vis_Stats()
+    :
+    num_clients(0),
+    snapshot_time(0.0f),
+    shared_time(0.0f),
+    client_time(0.0f)
+    {}
+};
+
 class Vis_Adapter {
 private:
     sf::TcpListener listener;
 
-    std::vector<std::unique_ptr<sf::TcpSocket>> clients;
+    // States to clients in UDP mode go out through this
+    sf::UdpSocket udp_socket;
 
-    Caret caret;
+    // Waiting for the next connection, kept so polling does not allocate
+    std::unique_ptr<sf::TcpSocket> pending_socket;
+
+    std::vector<Vis_Client> clients;
+
+    int keyframe_interval;
+    int roi_summary_interval;
+
+    // Current topology, its id goes up every time it changes
+    std::uint32_t topology_id;
+    std::vector<int> topology_signature;
+
+    Frame_Writer topology_frame;
+
+    // Layer states of the snapshot being served, nullptr where it did not capture the layer
+    std::vector<std::shared_ptr<const Layer_State>> states;
+
+    // Every state ever allocated, those no client holds any more get captured into again
+    std::vector<std::shared_ptr<Layer_State>> state_pool;
+
+    // Layers encoded this update (the first num_encoded_layers), looked up by (layer, base, compressed)
+    std::vector<Encoded_Layer> encoded_layers;
+
+    int num_encoded_layers;
+
+    Frame_Writer frame;
+    Frame_Writer fields_frame;
+    Frame_Writer weights_frame;
+
+    std::vector<unsigned char> datagram;
+
+    // States for viewers on this host, written once per update however many read them
+    Shm_Ring ring;
+
+    bool shared_memory;
+    std::string ring_name;
+
+    // Of the next message written into the ring
+    std::uint32_t ring_sequence;
+
+    // Recording states go into, with its own rate limit and sequence, the topology it last got and the states to diff against
+    Tail_File recording;
+
+    float record_rate;
+    sf::Time last_record_time;
+    int frames_recorded;
+
+    std::uint32_t recording_sequence;
+    std::uint32_t recorded_topology_id;
+
+    std::vector<std::shared_ptr<const Layer_State>> recorded_states;
+
+    // Guards the recording, started and stopped from the caller's thread
+    std::mutex recording_mutex;
+
+    // Triple buffer between update() and the network thread. update() fills the back snapshot and swaps it with the middle one,
+    // marked fresh. The thread swaps a fresh middle one with the front one it is done with, so neither ever waits on the other
+    Snapshot snapshots[3];
+
+    int back_snapshot;
+    std::atomic<int> middle_snapshot;
+    int front_snapshot;
+
+    // Layers the thread wants captured (per layer, those past the end are not), and the cells whose fields and the layers whose
+    // whole weights (for downloads) it wants copied once for the request with that id. update() keeps its own copies, refreshed
+    // whenever the lock is free
+    std::vector<unsigned char> wanted_layers;
+    std::vector<Caret> wanted_cells;
+    std::vector<unsigned char> wanted_weights;
+    std::uint64_t weights_request;
+
+    std::vector<unsigned char> update_wanted_layers;
+    std::vector<Caret> update_wanted_cells;
+    std::vector<unsigned char> update_wanted_weights;
+    std::uint64_t update_weights_request;
+
+    // Layer sizes for update() to find cell fields with, redone when the signature changes
+    std::vector<int> update_signature;
+    std::vector<Layer_Layout> update_layouts;
+
+    // Bounds per visible layer of the column update() extracts cell fields of, and pooling sums it never needs (fields stay unpooled)
+    std::vector<Field_Bounds> update_field_bounds;
+    std::vector<int> update_field_sums;
+
+    bool stopping;
+
+    // Guards the wanted layers, stats and stopping
+    mutable std::mutex snapshot_mutex;
+    std::condition_variable snapshot_ready;
+
+    // Newest weights the thread got per layer, whether it has any for the current topology, and when they came
+    std::vector<Weights_State> layer_weights;
+    std::vector<unsigned char> has_weights;
+    std::vector<sf::Time> weights_times;
+
+    // Newest fields the thread got of the cells clients' carets and pins are on
+    std::vector<Cell_Fields> cell_fields;
+
+    // Sizes of the layers of the snapshot being served, out of its signature
+    std::vector<Layer_Layout> layouts;
+
+    // Does everything but snapshotting: accepting, commands, serialization and sending
+    std::thread network_thread;
+
+    Encode_Scratch scratch;
+
+    Vis_Stats stats;
+
+    // Time since the adapter started, for rate limits and timestamps
+    sf::Clock uptime;
+
+    // When the last snapshot was served, the gap to it is how far ahead states due soon are asked for
+    sf::Time last_serve_time;
+
+    std::shared_ptr<Layer_State> acquire_state();
+
+    void network_thread_func();
+
+    // Accepts connections and handles what clients sent
+    void poll_clients();
+
+    // Sends what is due from the newest snapshot
+    void serve();
+
+    // Handles every complete command the client sent, false if it is not a viewer speaking this protocol
+    bool handle_commands(Vis_Client &client);
+
+    // Fills in the header of a frame, whose first bytes are reserved for it
+    void fill_header(Frame_Writer &writer, std::uint8_t type, std::uint32_t sequence);
+
+    // Fills in the header of a frame and sends it, false if the client disconnected
+    bool send(Vis_Client &client, Frame_Writer &writer, std::uint8_t type);
+
+    // Fills in the header of a frame and sends it to the client's UDP port in chunks, dropping what the socket cannot take right now.
+    // False if the frame is too large to split, nothing is sent then
+    bool send_datagrams(Vis_Client &client, Frame_Writer &writer, std::uint8_t type);
+
+    const Encoded_Layer &get_encoded_layer(int l, const Layer_State* base, bool compress);
+
+    // Writes a state with every layer in scratch.shared_layers in full into the ring
+    void write_shared_state(int num_layers);
+
+    // Appends the topology if it changed and a state with every layer to the recording, which is closed once full
+    void write_recorded_state(int num_layers);
+
+    // Sends the next chunk of the weights the client asked for, false if the client disconnected
+    bool send_weights(Vis_Client &client);
 
 public:
-    Vis_Adapter(unsigned short port = 54000);
+    // keyframe_interval: every this many frames a client gets every layer in full, otherwise only changed columns (0 disables deltas)
+    // roi_summary_interval: every this many frames a client gets the changes outside the columns it shows (see command_set_roi), 0 to always send them
+    // shared_memory: also write states into a shared memory ring, so viewers on this host can skip the sockets (POSIX only)
+    Vis_Adapter(unsigned short port = 54000, int keyframe_interval = 60, int roi_summary_interval = 15, bool shared_memory = false);
+
+    ~Vis_Adapter();
 
+    // Snapshots the hidden states (and, when asked, the fields of cells viewers look at or the weights of a layer being downloaded)
+    // for the network thread and returns, never waiting on it.
+    // Everything else happens on that thread, which works from the snapshots alone
     void update(const Hierarchy &h, const std::vector<const Image_Encoder*> &encs);
+
+    // Also appends states (at most max_rate per second, 0 for every update) to a file at path preallocated for capacity bytes,
+    // which NeoVis can tail while it grows and replay afterwards. Recording stops once the file is full. POSIX only, false elsewhere
+    bool start_recording(const std::string &path, size_t capacity, float max_rate = 0.0f);
+
+    // False if the file could not be cut down to what was recorded, it is still complete then
+    bool stop_recording() {
+        std::lock_guard<std::mutex> lock(recording_mutex);
+
+        return recording.close();
+    }
+
+    Vis_Stats get_stats() const {
+        std::lock_guard<std::mutex> lock(snapshot_mutex);
+
+        return stats;
+    }
 };
@@ -11,8 +11,61 @@ import select
 import struct
 import sys
 import threading
+import time
 import pyaogmaneo as neo
 
+# Must match source/protocol.h
+FRAME_MAGIC = 0x5349564e
+PROTOCOL_VERSION = 12
+
+MESSAGE_TOPOLOGY = 0
+MESSAGE_STATE = 1
+MESSAGE_FIELDS = 2
+
+COMMAND_HELLO = 0
+COMMAND_SET_CARET = 1
+
+CSDR_ENCODING_RAW = 0
+CSDR_ENCODING_RAW32 = 3
+FIELD_CHANGED = 0
+FIELD_ENCODING_RAW = 0
+
+# LEB128, used for dimensions
+def varint(value):
+    b = bytearray()
+
+    while value >= 0x80:
+        b.append((value & 0x7f) | 0x80)
+        value >>= 7
+
+    b.append(value)
+
+    return b
+
+def recv_exactly(conn, size):
+    b = bytearray()
+
+    while len(b) < size:
+        chunk = conn.recv(size - len(b))
+
+        if len(chunk) == 0:
+            raise ConnectionError()
+
+        b += chunk
+
+    return b
+
+# Commands are a 4-byte header (size, type) followed by size bytes of body
+def recv_command(conn):
+    size, command_type = struct.unpack("HB1x", recv_exactly(conn, 4))
+
+    return command_type, recv_exactly(conn, size)
+
+def name_bytes(name):
+    bname = name.encode()
+
+    return varint(len(bname)) + bname
+
 class VisAdapter:
     def __init__(self, port=54000):
         self.stop = False
@@ -30,12 +83,38 @@ class VisAdapter:
         self.clients = []
 
         self.caret = None
+        self.caret_id = 0
+
+        self.start_time = time.monotonic_ns()
+
+        self.topology_id = 0
+        self.topology_signature = None
+        self.btopology = None
 
     def _listen(self):
         while not self.stop:
             conn, addr = self.listener.accept()
 
-            self.clients.append((conn, addr))
+            # The viewer opens with a Hello command (magic, version, codecs), no codecs are supported here
+            try:
+                command_type, b = recv_command(conn)
+
+                if command_type != COMMAND_HELLO:
+                    raise ValueError()
+
+                magic, version, codecs = struct.unpack("IHH8x", b)
+
+                if magic != FRAME_MAGIC or version != PROTOCOL_VERSION:
+                    raise ValueError()
+            except Exception:
+                conn.close()
+
+                print("Rejected a client with a mismatching protocol.")
+
+                continue
+
+            # Then the id of the topology the client was sent and the sequence of its next message
+            self.clients.append([ conn, addr, None, 0 ])
 
             print("Connected!")
 
@@ -53,7 +132,109 @@ class VisAdapter:
         self.listener.shutdown(2)
         self.listener.close()
 
+    # Header (sequence counting messages to this client, microsecond timestamp) and body
+    def _send(self, client, message_type, body):
+        timestamp = (time.monotonic_ns() - self.start_time) // 1000
+
+        client[0].sendall(struct.pack("IHBBIIQ", FRAME_MAGIC, PROTOCOL_VERSION, message_type, 0, client[3], len(body), timestamp) + body)
+
+        client[3] = (client[3] + 1) & 0xffffffff
+
+    # Indices take 16 bits unless the column size needs more
+    def _serialize_indices(self, sdr, num_columns, column_size):
+        if column_size <= 0x10000:
+            return struct.pack("B", CSDR_ENCODING_RAW) + struct.pack(str(num_columns) + "H", *[ int(sdr[i]) for i in range(num_columns) ])
+
+        return struct.pack("B", CSDR_ENCODING_RAW32) + struct.pack(str(num_columns) + "i", *[ int(sdr[i]) for i in range(num_columns) ])
+
+    # Layer sizes and visible layer counts, the viewer only needs to hear about them when they change
+    def _get_topology_signature(self, h: neo.Hierarchy, encs: [ neo.ImageEncoder ]):
+        signature = [ len(encs) ]
+
+        for l in range(len(encs)):
+            signature.append((tuple(encs[l].get_hidden_size()), encs[l].get_num_visible_layers()))
+
+        for l in range(h.get_num_layers()):
+            signature.append((tuple(h.get_hidden_size(l)), h.get_num_encoder_visible_layers(l)))
+
+        return signature
+
+    def _serialize_topology(self):
+        num_encs = self.topology_signature[0]
+        layers = self.topology_signature[1:]
+
+        b = bytearray()
+
+        b += struct.pack("I", self.topology_id)
+        b += varint(len(layers)) + varint(num_encs)
+
+        for l in range(len(layers)):
+            size, num_visible_layers = layers[l]
+
+            b += name_bytes("Pre-encoder " + str(l) if l < num_encs else "Layer " + str(l - num_encs))
+            b += varint(int(size[0])) + varint(int(size[1])) + varint(int(size[2]))
+            b += varint(num_visible_layers)
+
+            # Visible layer sizes and radii are not known here, sent as 0
+            for f in range(num_visible_layers):
+                b += name_bytes("field " + str(f))
+                b += varint(0) + varint(0) + varint(0) + varint(0)
+
+        return b
+
+    # Layer CSDRs do not depend on the client, so they are serialized once per update
+    def _serialize_layers(self, h: neo.Hierarchy, encs: [ neo.ImageEncoder ]):
+        num_layers = h.get_num_layers()
+        num_encs = len(encs)
+
+        b = bytearray()
+
+        b += struct.pack("I", self.topology_id)
+
+        # Add encoders
+        for l in range(num_encs):
+            blayer = bytearray()
+
+            size = encs[l].get_hidden_size()
+
+            width = size[0]
+            height = size[1]
+            column_size = size[2]
+
+            sdr = encs[l].get_hidden_cis()
+
+            blayer += self._serialize_indices(sdr, width * height, column_size)
+
+            b += blayer
+
+        for l in range(num_layers):
+            blayer = bytearray()
+
+            size = h.get_hidden_size(l)
+
+            width = size[0]
+            height = size[1]
+            column_size = size[2]
+
+            sdr = list(h.get_hidden_cis(l))
+
+            blayer += self._serialize_indices(sdr, width * height, column_size)
+
+            b += blayer
+
+        return b
+
     def update(self, h: neo.Hierarchy, encs: [ neo.ImageEncoder ]):
+        blayers = None
+
+        if len(self.clients) > 0:
+            signature = self._get_topology_signature(h, encs)
+
+            if signature != self.topology_signature:
+                self.topology_id = (self.topology_id + 1) & 0xffffffff
+                self.topology_signature = signature
+                self.btopology = self._serialize_topology()
+
         new_clients = []
         
         for client in self.clients:
@@ -73,12 +254,15 @@ class VisAdapter:
             if ready:
                 while ready and len(ready_to_read) > 0:
                     try:
-                        b = bytearray()
-                        
-                        while len(b) < 16:
-                            b += conn.recv(16 - len(b))
+                        command_type, b = recv_command(conn)
 
-                        self.caret = struct.unpack("Hiii", b)
+                        # Other commands (subscriptions, rate limits, keyframe requests) are not supported here and skipped
+                        if command_type == COMMAND_SET_CARET:
+                            # Requested field bit depth and pooling are not supported either, full fields are sent
+                            layer, field_bits, field_pool, x, y, z, caret_id = struct.unpack("HBBiiiI", b)
+
+                            self.caret = (layer, x, y, z)
+                            self.caret_id = caret_id
                     except Exception:
                         conn.close()
 
@@ -102,47 +286,12 @@ class VisAdapter:
                     num_layers = h.get_num_layers()
                     num_encs = len(encs)
 
-                    b = bytearray()
-
-                    b += struct.pack("H", int(num_layers + num_encs))
-                    b += struct.pack("H", int(num_encs))
+                    # Shared by all clients
+                    if blayers is None:
+                        blayers = self._serialize_layers(h, encs)
 
-                    # Add encoders
-                    for l in range(num_encs):
-                        blayer = bytearray()
-
-                        size = encs[l].get_hidden_size()
-
-                        width = size[0]
-                        height = size[1]
-                        column_size = size[2]
-
-                        blayer += struct.pack("HHH", int(width), int(height), int(column_size))
-
-                        sdr = encs[l].get_hidden_cis()
-
-                        for i in range(width * height):
-                            blayer += struct.pack("h", sdr[i])
-
-                        b += blayer
-
-                    for l in range(num_layers):
-                        blayer = bytearray()
-
-                        size = h.get_hidden_size(l)
-
-                        width = size[0]
-                        height = size[1]
-                        column_size = size[2]
-
-                        blayer += struct.pack("HHH", int(width), int(height), int(column_size))
-
-                        sdr = list(h.get_hidden_cis(l))
-
-                        for i in range(width * height):
-                            blayer += struct.pack("h", sdr[i])
-
-                        b += blayer
+                    # Fields go in their own message, sent ahead of the layers
+                    b = bytearray(struct.pack("II", self.topology_id, self.caret_id))
 
                     assert self.caret is None or (self.caret[0] >= 0 and self.caret[0] < h.get_num_layers() + num_encs)
                     
@@ -165,27 +314,19 @@ class VisAdapter:
 
                             num_fields = 0 if not in_bounds else h.get_num_encoder_visible_layers(layer_index - num_encs)
                     
-                    b += struct.pack("H", num_fields)
+                    b += varint(layer_index) + varint(num_fields)
 
                     if layer_index < num_encs:
                         enc_index = layer_index
                         enc = encs[enc_index]
 
                         for f in range(num_fields):
-                            bfield = bytearray()
-                            
-                            name = "field" + str(f)
-
-                            bname = name.encode()
-
-                            while len(bname) < 64:
-                                bname += struct.pack("c", b"\0")
-
-                            bfield += bname
+                            # Always resent in full here
+                            bfield = bytearray(struct.pack("B", FIELD_CHANGED))
 
                             field, field_size = encs[enc_index].get_receptive_field(f, pos)
 
-                            bfield += struct.pack("iii", field_size[0], field_size[1], field_size[2])
+                            bfield += varint(field_size[0]) + varint(field_size[1]) + varint(field_size[2]) + struct.pack("B", FIELD_ENCODING_RAW)
 
                             for i in range(field_size[0] * field_size[1] * field_size[2]):
                                 bfield += struct.pack("B", field[i])
@@ -193,20 +334,12 @@ class VisAdapter:
                             b += bfield
                     else:
                         for f in range(num_fields):
-                            bfield = bytearray()
-                            
-                            name = "field" + str(f)
-
-                            bname = name.encode()
-
-                            while len(bname) < 64:
-                                bname += struct.pack("c", b"\0")
-
-                            bfield += bname
+                            # Always resent in full here
+                            bfield = bytearray(struct.pack("B", FIELD_CHANGED))
 
                             field, field_size = h.get_encoder_receptive_field(layer_index - num_encs, f, pos)
      
-                            bfield += struct.pack("iii", field_size[0], field_size[1], field_size[2])
+                            bfield += varint(field_size[0]) + varint(field_size[1]) + varint(field_size[2]) + struct.pack("B", FIELD_ENCODING_RAW)
 
                             for i in range(field_size[0] * field_size[1] * field_size[2]):
                                 bfield += struct.pack("B", field[i])
@@ -214,7 +347,14 @@ class VisAdapter:
                             b += bfield
 
                     try:
-                        conn.send(b)
+                        # Topology first if the client has not seen this one yet
+                        if client[2] != self.topology_id:
+                            self._send(client, MESSAGE_TOPOLOGY, self.btopology)
+
+                            client[2] = self.topology_id
+
+                        self._send(client, MESSAGE_FIELDS, b)
+                        self._send(client, MESSAGE_STATE, blayers)
                     except Exception:
                         conn.close()
 